@@ -0,0 +1,198 @@
+#!/bin/sh
+# Regression checks on a small sample export: redaction (text, attachment
+# placeholders, quote excerpts), RFC 2822 and ISO Sent times, the --tail and
+# --since boundaries, the --index/--query round trip and the --bisect memo.
+#
+# Usage: tests/regress.sh [path/to/txt2tex]
+# Without an argument, txt2tex.c is compiled into the scratch directory.
+# No LaTeX installation is needed; --bisect runs a stand-in engine.
+
+set -u
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/txt2tex-regress.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+
+if [ $# -gt 0 ]; then
+   case $1 in
+      /*) bin=$1 ;;
+      *) bin=$(pwd)/$1 ;;
+   esac
+else
+   bin=$work/txt2tex
+   ${CC:-cc} -O2 -pthread -o "$bin" "$repo/txt2tex.c" || exit 1
+fi
+
+failures=0
+
+fail()
+{
+   echo "FAIL: $*"
+   failures=$((failures + 1))
+}
+
+# expect_in FILE TEXT / expect_not_in FILE TEXT: fixed-string checks
+expect_in()
+{
+   grep -qF -- "$2" "$1" || fail "$1 lacks '$2'"
+}
+
+expect_not_in()
+{
+   if grep -qF -- "$2" "$1"; then
+      fail "$1 contains '$2'"
+   fi
+}
+
+# run NAME ARGS...: runs txt2tex in the scratch directory, output in NAME.log
+run()
+{
+   name=$1
+   shift
+   if ! (cd "$work" && "$bin" "$@") >"$work/$name.log" 2>&1; then
+      fail "txt2tex $* (see below)"
+      cat "$work/$name.log"
+   fi
+}
+
+mkdir "$work/attachments"
+printf 'PNG-ish payload\n' >"$work/attachments/photo.png"
+
+# Five messages: RFC 2822 and ISO Sent lines, a redacted name in the text,
+# in an unmatched attachment reference and across the cut of a quote excerpt
+cat >"$work/chat.txt" <<'EOF'
+Conversation: Alice (+491234)
+Type: incoming
+From: Alice (+491231)
+Sent: Mon, 01 Jan 2024 10:00:00 +0000
+Received: Mon, 01 Jan 2024 10:00:01 +0000
+
+0123456789012345678901234567890123456789012345678901 Johnathan Smithers was here
+Attachment: photo.png (image/png, 16 bytes)
+
+Conversation: Alice (+491234)
+Type: outgoing
+From: Bob (+491230)
+Sent: Tue, 02 Jan 2024 23:59:59 +0000
+Received: Tue, 02 Jan 2024 23:59:59 +0000
+
+Quote: Alice, Mon, 01 Jan 2024 10:00:00 +0000
+> 0123456789012345678901234567890123456789012345678901 Johnathan Smithers was here
+
+Seen it, call +49 170 5550199
+Attachment: Johnathan Smithers.pdf (application/pdf, 4242 bytes)
+
+Conversation: Alice (+491234)
+Type: incoming
+From: Alice (+491231)
+Sent: 2024-01-03 00:00:00
+Received: 2024-01-03 00:00:01
+
+third message wombat
+
+Conversation: Alice (+491234)
+Type: outgoing
+From: Bob (+491230)
+Sent: 2024-01-07 12:00:00
+Received: 2024-01-07 12:00:01
+
+fourth message wombat and another wombat
+
+Conversation: Alice (+491234)
+Type: incoming
+From: Alice (+491231)
+Sent: Sun, 07 Jan 2024 23:30:00 -0100
+Received: Sun, 07 Jan 2024 23:30:01 -0100
+
+fifth message
+EOF
+printf 'Johnathan Smithers\n' >"$work/terms.txt"
+
+# Redaction: text, placeholder and quote excerpt in .tex and HTML
+run redact --redact --redact-terms terms.txt --dedup-quotes --target tex:red.tex --target html:red.html chat.txt
+for out in "$work/red.tex" "$work/red.html"; do
+   expect_not_in "$out" "Johnathan"
+   expect_not_in "$out" "Smithers"
+   expect_not_in "$out" "5550199"
+done
+expect_in "$work/red.tex" '\redacted{REDACTED}'
+expect_in "$work/red.tex" '\redacted{PHONE}'
+expect_in "$work/red.tex" 'Reply to Alice'
+expect_in "$work/red.html" '<b>[REDACTED]</b>'
+expect_in "$work/redact.log" 'Replaced 1 quotes'
+
+# Without --dedup-quotes the quoted line itself is redacted
+run quote --redact-terms terms.txt chat.txt
+expect_not_in "$work/chat.tex" "Johnathan"
+expect_in "$work/chat.tex" "photo.png"
+
+# Sent times: both formats are parsed, days are counted in the sender's zone
+run analytics --analytics days.csv chat.txt
+expect_in "$work/days.csv" 'day,2024-01-01,1,'
+expect_in "$work/days.csv" 'day,2024-01-02,1,'
+expect_in "$work/days.csv" 'day,2024-01-03,1,'
+expect_in "$work/days.csv" 'day,2024-01-07,2,'
+
+# --tail: exactly the last N messages
+run tail --tail 2 chat.txt
+expect_in "$work/chat.tex" "fourth message"
+expect_in "$work/chat.tex" "fifth message"
+expect_not_in "$work/chat.tex" "third message"
+
+# --since: a message sent exactly at the bound is included, one second
+# before is not; ISO times without an offset are UTC
+run since --since 2024-01-03 chat.txt
+expect_in "$work/chat.tex" "third message"
+expect_not_in "$work/chat.tex" "Seen it"
+run since-time --since "2024-01-03 00:00:01" chat.txt
+expect_not_in "$work/chat.tex" "third message"
+expect_in "$work/chat.tex" "fourth message"
+run since-offset --since "2024-01-08 00:30:00" chat.txt
+expect_in "$work/chat.tex" "fifth message"
+expect_not_in "$work/chat.tex" "fourth message"
+
+# --index/--query: words and phrases map back to message and input line
+run index --index chat.txt
+(cd "$work" && "$bin" --query wombat chat.txt) >"$work/query.out" 2>"$work/query.log"
+[ "$(cut -f1,3 "$work/query.out" | tr '\t\n' ' ')" = "3 28 4 36 " ] ||
+   fail "--query wombat printed: $(cat "$work/query.out")"
+expect_in "$work/query.log" "2 lines in 2 messages"
+(cd "$work" && "$bin" --query "another WOMBAT" chat.txt) >"$work/phrase.out" 2>/dev/null
+[ "$(cut -f1 "$work/phrase.out")" = "4" ] || fail "--query phrase printed: $(cat "$work/phrase.out")"
+(cd "$work" && "$bin" --query "wombat another" chat.txt) >"$work/none.out" 2>/dev/null
+[ ! -s "$work/none.out" ] || fail "--query out-of-order phrase printed: $(cat "$work/none.out")"
+offset=$(cut -f2 "$work/query.out" | head -n 1)
+tail -c +"$((offset + 1))" "$work/chat.tex" | head -n 20 | grep -qF "third message" ||
+   fail "--query offset $offset does not lead to the message in chat.tex"
+
+# --bisect: a changed image invalidates the memoized results of the parts
+# that include it. The stand-in engine fails when an included file says FAILME
+mkdir "$work/bin"
+cat >"$work/bin/lualatex" <<'EOF'
+#!/bin/sh
+for tex; do :; done
+for f in $(grep -o 'attachments/[^}]*' "$tex"); do
+   if grep -q FAILME "$f"; then
+      exit 1
+   fi
+done
+exit 0
+EOF
+chmod +x "$work/bin/lualatex"
+PATH=$work/bin:$PATH
+export PATH
+run bisect --bisect --jobs 2 chat.txt
+expect_in "$work/bisect.log" 'compiles without errors'
+run bisect-memo --bisect --jobs 2 chat.txt
+expect_in "$work/bisect-memo.log" 'Bisection compiled 0 ranges'
+printf 'FAILME payload!\n' >"$work/attachments/photo.png"   # Same size
+touch -t 202401010000 "$work/attachments/photo.png"
+(cd "$work" && "$bin" --bisect --jobs 2 chat.txt) >"$work/bisect-image.log" 2>&1
+expect_in "$work/bisect-image.log" "Attachment 'attachments/photo.png' (input line 8) fails on its own"
+printf 'PNG-ish payload\n' >"$work/attachments/photo.png"
+
+if [ "$failures" -gt 0 ]; then
+   echo "$failures check(s) failed"
+   exit 1
+fi
+echo "All checks passed"
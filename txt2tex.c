@@ -5,7 +5,17 @@
  * into a LaTeX document suitable for compilation with lualatex.
  *
  * Usage:
- *   txt2tex <input_file>
+ *   txt2tex [options] [--compile | --bisect] [--jobs N] <input_file>
+ *   txt2tex [--trace out.json] --plan N <input_file>
+ *   txt2tex [options] --worker K <plan_file>
+ *   txt2tex [options] --stitch <plan_file>
+ *   txt2tex [options] --target FORMAT:PATH[:images=DIR][:proof] ... <input_file>
+ *   txt2tex --query TEXT <input_file>
+ *
+ *   Options: --trace out.json, --engine lualatex|pdflatex, --emoji-dir DIR,
+ *   --proof, --redact, --redact-terms FILE, --highlight, --attachment-cache,
+ *   --size-tolerance N[%], --analytics FILE, --index, --dedup-quotes,
+ *   --tail N, --since DATE
  *
  * The program reads the specified input text file and generates an output file
  * with the same name but with a .tex extension. For example, if the input file
@@ -22,11 +32,38 @@
  *   - Generates a complete LaTeX document with proper preamble and formatting
  *
  * Attachment Processing:
- *   - Scans the "./attachments" directory for available files
- *   - Matches attachments by exact filename first, then by file size
+ *   - Looks up named references in the "./attachments" directory directly;
+ *     the directory is listed only for the first match by size, or after
+ *     256 names
+ *   - Matches attachments by exact filename first, then by file size using
+ *     a sorted size index
+ *   - With --size-tolerance N or N%, references without an exact match take
+ *     the closest size within the tolerance; ties prefer files whose type
+ *     agrees with the MIME type, then modification times (see sigtop att -m)
+ *     closest to the message's sent time; files that some reference matches
+ *     exactly are left to it
  *   - Images are included using \includegraphics
  *   - Non-image attachments are listed as text references
  *   - Unmatched attachments are noted in the output
+ *   - With --attachment-cache, matches are saved to "<name>.attcache" and
+ *     reused on the next run for files whose size and modification time are
+ *     unchanged; only the remaining references are searched for
+ *
+ * Tail Mode (--tail N, --since DATE):
+ *   - Reads the export backwards from the end in 4 MiB blocks until the
+ *     start of the N-th last message, or of the first message sent before
+ *     DATE, is found, then converts forward from the next message
+ *   - Only attachments referenced in that range are looked up; files used
+ *     by earlier messages are not excluded from its size matches
+ *
+ * Quoted Replies (--dedup-quotes):
+ *   - A reply starts with "Quote: <sender>, <sent time>" followed by the
+ *     quoted text on lines starting with ">"
+ *   - If the quoted message was emitted recently (the last few thousand
+ *     messages, by sender and sent time), the quote is replaced by one line
+ *     naming sender and time with the first 60 bytes of that message
+ *   - Quotes of other messages are written as text; the skipped bytes are
+ *     reported with the conversion statistics
  *
  * Output Format:
  *   - Creates a LaTeX article document with A4 paper size
@@ -34,30 +71,141 @@
  *   - Configures emoji font support (Segoe UI Emoji on Windows)
  *   - Preserves line breaks in the original text
  *
+ * pdfLaTeX Output (--engine pdflatex):
+ *   - Uses fontenc/inputenc/lmodern instead of fontspec, so the document
+ *     compiles with the much faster pdflatex
+ *   - Latin-1, Latin Extended-A and common punctuation map to LaTeX text
+ *     commands through precomputed lookup tables
+ *   - Emoji and other codepoints without a glyph are included as small PNGs
+ *     from --emoji-dir (Twemoji or Noto file names) or shown as U+XXXX
+ *     placeholders
+ *
+ * Redaction (--redact, --redact-terms FILE, --highlight):
+ *   - --redact replaces phone numbers, e-mail addresses and IBANs (checked
+ *     with the ISO 13616 checksum) in text lines
+ *   - --redact-terms adds a list of terms, one per line, matched
+ *     case-insensitively (ASCII folding) on word boundaries
+ *   - All terms are compiled into one Aho-Corasick automaton and matched in
+ *     the same single pass as the built-in scanners, ahead of escaping
+ *   - --highlight wraps matches in a yellow box for review instead
+ *   - Match counts are reported with the conversion statistics
+ *
+ * Proof Mode (--proof):
+ *   - Images are replaced by empty frames labelled with the file name, sized
+ *     from the image header dimensions exactly as \includegraphics would
+ *     scale the image, so page breaks match the final document
+ *   - Images whose dimensions cannot be read are included as usual
+ *
+ * Parallel Compilation (--compile):
+ *   - Estimates the typeset page count of every message from its text length
+ *     and the header dimensions of its images
+ *   - Cuts the document at message boundaries into shards of roughly equal
+ *     size, written to "<name>-shards/" with the same preamble and a page
+ *     number offset
+ *   - Runs up to N (--jobs, default: number of CPUs) lualatex processes
+ *     concurrently and merges the shard PDFs into "<name>.pdf"
+ *   - Shards whose first page number was mis-estimated are recompiled once
+ *     with the corrected offset
+ *
+ * Compile Failure Bisection (--bisect):
+ *   - Compiles the document; if it fails, compiles message-aligned parts of
+ *     it on their own, N (--jobs) at a time, and keeps the first failing part
+ *     until a single message is left
+ *   - Then compiles the attachment blocks of that message separately, and
+ *     reports the input line numbers of the message and failing attachments
+ *   - Results are memoized by a hash of the content and of the path, size
+ *     and modification time of the images it includes in
+ *     "<name>-bisect/memo", so reruns only compile parts that changed
+ *
+ * Distributed Conversion (--plan / --worker / --stitch):
+ *   - --plan scans the export once and writes "<name>.plan", a manifest of
+ *     message-aligned byte ranges with the first message number, timestamp
+ *     and resolved attachment files of each range
+ *   - --worker K converts range K into "<name>.part-KKK.tex", needing only
+ *     the attachment files the manifest lists for it
+ *   - --stitch joins the fragments into "<name>.tex", identical to the output
+ *     of a single run
+ *
+ * Multiple Targets (--target):
+ *   - Writes several outputs from one conversion, e.g. a print and a screen
+ *     LaTeX document and an HTML page, instead of "<name>.tex"
+ *   - Lines are parsed, matched, redacted and escaped once into shared
+ *     in-memory chunks; every target renders the chunks on its own thread
+ *     with its own preamble and image profile
+ *   - Image profiles: images=DIR uses the same-named file from DIR where
+ *     present (e.g. downscaled copies), proof draws frames as with --proof
+ *   - Attachment paths are written relative to each target's directory
+ *
+ * Analytics (--analytics FILE):
+ *   - Collects statistics in the conversion pass: messages per sender,
+ *     messages per day (in the sender's time zone), attachment count and
+ *     volume per MIME type, and emoji frequency
+ *   - Writes them as one line of JSON, or as CSV rows of section, key,
+ *     count and bytes if FILE ends in ".csv"
+ *   - Reports the time spent collecting as a share of the conversion pass,
+ *     estimated from a sample of the lines
+ *   - With --redact or --redact-terms, sender names are written redacted
+ *
+ * Search Index (--index, --query):
+ *   - --index writes "<name>.idx" next to "<name>.tex": every word of the
+ *     written text lines (after redaction), case-folded, with the message
+ *     number, input line and word position of each occurrence
+ *   - The file is read through mmap; --query looks up a word or phrase by
+ *     binary search and prints message number, byte offset of the message
+ *     in "<name>.tex" and input line number for every matching line
+ *
+ * Tracing (--trace out.json):
+ *   - Records spans for directory scan batches, chunks of 4096 converted
+ *     lines, attachment matching, image header reads and lualatex jobs
+ *     into per-thread ring buffers
+ *   - Writes them as Chrome trace-event JSON, viewable in Perfetto or
+ *     chrome://tracing
+ *
  * Compile with:
- *   gcc -o txt2tex txt2tex.c
+ *   gcc -o txt2tex txt2tex.c -pthread
  *
  * Run with:
- *   ./txt2tex <input_file>
+ *   ./txt2tex [options] <input_file>
  *
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 #define MaxPathLen 4096
 
+// Open-addressing hash map from strings to integers; keys are copied
+typedef struct
+{
+   char **keys;
+   long long *values;
+   size_t count;
+   size_t capacity;   // Power of two
+} StrMap;
+
 typedef struct
 {
    char fileName[MaxPathLen];
    char fullPath[MaxPathLen];
    long long fileSize;
+   long long mtime;   // Modification time in seconds
    int used;
+   int reserved;      // Some reference matches it exactly; approximate matches skip it
 } AttachmentFile;
 
 typedef struct
@@ -65,14 +213,306 @@ typedef struct
    AttachmentFile *items;
    size_t count;
    size_t capacity;
+   size_t *bySize;   // Item indices sorted by size, then index; built on first size lookup
+   size_t *nextOpen; // Skip links over taken files in the size index, upwards...
+   size_t *prevOpen; // ...and downwards; see openSlot
+   StrMap byName;    // File name -> item index
+   int listed;       // Holds every file of the directory; otherwise only probed ones
+   int dirFd;        // Until listed: the directory, for probing names
+   const char *dirPath;
+   size_t probes;
 } AttachmentList;
 
+
 static void fatal(const char *msg)
 {
    fprintf(stderr, "Error: %s\n", msg);
    exit(1);
 }
 
+#define HashSeed 14695981039346656037ULL
+
+static uint64_t hashBytesFrom(uint64_t h, const void *data, size_t n)
+{
+   // FNV-1a, continuing from h (HashSeed for a fresh hash)
+   const unsigned char *p = (const unsigned char *)data;
+   for(size_t i = 0; i < n; i++)
+   {
+      h ^= p[i];
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+static uint64_t hashBytes(const void *data, size_t n)
+{
+   return hashBytesFrom(HashSeed, data, n);
+}
+
+static void strMapInit(StrMap *m)
+{
+   m->keys = NULL;
+   m->values = NULL;
+   m->count = 0;
+   m->capacity = 0;
+}
+
+static size_t strMapSlot(const StrMap *m, const char *key)
+{
+   size_t mask = m->capacity - 1;
+   size_t i = (size_t)hashBytes(key, strlen(key)) & mask;
+   while(m->keys[i] && strcmp(m->keys[i], key) != 0)
+   {
+      i = (i + 1) & mask;
+   }
+   return i;
+}
+
+static long long *strMapFind(const StrMap *m, const char *key)
+{
+   if(m->capacity == 0)
+   {
+      return NULL;
+   }
+   size_t i = strMapSlot(m, key);
+   return m->keys[i] ? &m->values[i] : NULL;
+}
+
+static long long *strMapInsert(StrMap *m, const char *key, long long value)
+{
+   // Returns the value slot of key, adding it with the given value if absent
+   if((m->count + 1) * 4 > m->capacity * 3)
+   {
+      StrMap grown;
+      grown.capacity = (m->capacity == 0) ? 64 : (m->capacity * 2);
+      grown.count = m->count;
+      grown.keys = (char **)calloc(grown.capacity, sizeof(char *));
+      grown.values = (long long *)malloc(grown.capacity * sizeof(long long));
+      if(!grown.keys || !grown.values)
+      {
+         fatal("Out of memory growing hash map");
+      }
+      for(size_t i = 0; i < m->capacity; i++)
+      {
+         if(m->keys[i])
+         {
+            size_t j = strMapSlot(&grown, m->keys[i]);
+            grown.keys[j] = m->keys[i];
+            grown.values[j] = m->values[i];
+         }
+      }
+      free(m->keys);
+      free(m->values);
+      *m = grown;
+   }
+
+   size_t i = strMapSlot(m, key);
+   if(!m->keys[i])
+   {
+      m->keys[i] = strdup(key);
+      if(!m->keys[i])
+      {
+         fatal("Out of memory copying hash map key");
+      }
+      m->values[i] = value;
+      m->count++;
+   }
+   return &m->values[i];
+}
+
+static void strMapFree(StrMap *m)
+{
+   for(size_t i = 0; i < m->capacity; i++)
+   {
+      free(m->keys[i]);
+   }
+   free(m->keys);
+   free(m->values);
+   strMapInit(m);
+}
+
+enum
+{
+   EngineLuaLatex,
+   EnginePdfLatex
+};
+
+static const char *const engineCommands[] = { "lualatex", "pdflatex" };
+
+typedef struct
+{
+   int proof;       // Replace images by labelled frames of the same size
+   int redact;      // Define the redaction macros
+   int highlight;   // Redaction wraps matches for review instead of replacing them
+   int engine;      // EngineLuaLatex or EnginePdfLatex
+   const char *emojiDir;   // pdfLaTeX: directory of emoji PNGs, NULL for placeholders
+   StrMap *emojiCache;     // pdfLaTeX: emoji image name -> found variant
+} DocumentOptions;
+
+// Chrome trace-event recording (--trace). Every thread appends spans to its
+// own ring buffer, so recording takes no locks; buffers are pushed onto a
+// global list on first use and written out as JSON at exit.
+#define TraceRingSize 65536
+#define TraceJobLanes 100000   // Compile job slots are drawn from this tid on, above any thread
+
+typedef struct
+{
+   const char *name;   // Static strings only
+   const char *cat;
+   long long startUs;
+   long long durUs;
+   long long arg;      // Span-specific count (lines, entries, bytes), -1 if none
+   int lane;           // Track to draw the span on, 0 for the recording thread
+} TraceSpan;
+
+typedef struct TraceBuffer
+{
+   TraceSpan spans[TraceRingSize];
+   unsigned long long written;   // Spans recorded; older ones are overwritten
+   int tid;
+   struct TraceBuffer *next;
+} TraceBuffer;
+
+static int traceEnabled = 0;
+static struct timespec traceEpoch;
+static _Atomic(TraceBuffer *) traceBuffers = NULL;
+static atomic_int traceNextTid = 1;
+static atomic_int traceJobSlots = 0;   // Job slots that recorded a span
+static _Thread_local TraceBuffer *traceLocal = NULL;
+
+static long long traceNowUs(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long)(ts.tv_sec - traceEpoch.tv_sec) * 1000000LL + (ts.tv_nsec - traceEpoch.tv_nsec) / 1000;
+}
+
+static void traceInit(void)
+{
+   clock_gettime(CLOCK_MONOTONIC, &traceEpoch);
+   traceEnabled = 1;
+}
+
+static long long traceBegin(void)
+{
+   return traceEnabled ? traceNowUs() : 0;
+}
+
+static void traceEndLane(const char *cat, const char *name, long long startUs, long long arg, int lane)
+{
+   if(!traceEnabled)
+   {
+      return;
+   }
+
+   TraceBuffer *buf = traceLocal;
+   if(!buf)
+   {
+      buf = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+      if(!buf)
+      {
+         return;   // Tracing is best effort
+      }
+      buf->tid = atomic_fetch_add(&traceNextTid, 1);
+      buf->next = atomic_load(&traceBuffers);
+      while(!atomic_compare_exchange_weak(&traceBuffers, &buf->next, buf))
+      {
+      }
+      traceLocal = buf;
+   }
+
+   TraceSpan *span = &buf->spans[buf->written % TraceRingSize];
+   span->name = name;
+   span->cat = cat;
+   span->startUs = startUs;
+   span->durUs = traceNowUs() - startUs;
+   span->arg = arg;
+   span->lane = lane;
+   buf->written++;
+
+   // Lets traceWrite name the job tracks
+   int slots = atomic_load(&traceJobSlots);
+   while(lane - TraceJobLanes >= slots && !atomic_compare_exchange_weak(&traceJobSlots, &slots, lane - TraceJobLanes + 1))
+   {
+   }
+}
+
+static void traceEnd(const char *cat, const char *name, long long startUs, long long arg)
+{
+   traceEndLane(cat, name, startUs, arg, 0);
+}
+
+static void traceFree(void)
+{
+   TraceBuffer *buf = atomic_exchange(&traceBuffers, NULL);
+   while(buf)
+   {
+      TraceBuffer *next = buf->next;
+      free(buf);
+      buf = next;
+   }
+   traceLocal = NULL;
+}
+
+static int traceWrite(const char *path)
+{
+   // Called once all recording threads have finished; releases the buffers
+   FILE *out = fopen(path, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", path, strerror(errno));
+      traceFree();
+      return 0;
+   }
+
+   int pid = (int)getpid();
+   unsigned long long dropped = 0;
+   int first = 1;
+
+   fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+   int slots = atomic_load(&traceJobSlots);
+   for(int i = 0; i < slots; i++)
+   {
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"job %d\"}}",
+              first ? "" : ",\n", pid, TraceJobLanes + i, i + 1);
+      first = 0;
+   }
+   for(TraceBuffer *buf = atomic_load(&traceBuffers); buf; buf = buf->next)
+   {
+      fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+              first ? "" : ",\n", pid, buf->tid, (buf->tid == 1) ? "main" : "worker");
+      first = 0;
+
+      unsigned long long begin = (buf->written > TraceRingSize) ? buf->written - TraceRingSize : 0;
+      dropped += begin;
+      for(unsigned long long i = begin; i < buf->written; i++)
+      {
+         const TraceSpan *span = &buf->spans[i % TraceRingSize];
+         fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                 span->name, span->cat, span->startUs, span->durUs, pid, span->lane ? span->lane : buf->tid);
+         if(span->arg >= 0)
+         {
+            fprintf(out, ",\"args\":{\"n\":%lld}", span->arg);
+         }
+         fputc('}', out);
+      }
+   }
+   fputs("\n]}\n", out);
+   traceFree();
+
+   int ok = (fclose(out) == 0);
+   if(ok)
+   {
+      fprintf(stderr, "Wrote %s", path);
+      if(dropped > 0)
+      {
+         fprintf(stderr, " (%llu oldest spans dropped)", dropped);
+      }
+      fputc('\n', stderr);
+   }
+   return ok;
+}
+
 static int hasImageExtension(const char *name)
 {
    const char *dot = strrchr(name, '.');
@@ -110,6 +550,14 @@ static void attachmentListInit(AttachmentList *list)
    list->items = NULL;
    list->count = 0;
    list->capacity = 0;
+   list->bySize = NULL;
+   list->nextOpen = NULL;
+   list->prevOpen = NULL;
+   strMapInit(&list->byName);
+   list->listed = 1;
+   list->dirFd = -1;
+   list->dirPath = NULL;
+   list->probes = 0;
 }
 
 static void attachmentListPush(AttachmentList *list, const AttachmentFile *item)
@@ -125,15 +573,34 @@ static void attachmentListPush(AttachmentList *list, const AttachmentFile *item)
       list->items = newItems;
       list->capacity = newCap;
    }
+   strMapInsert(&list->byName, item->fileName, (long long)list->count);
    list->items[list->count++] = *item;
+   free(list->bySize);
+   list->bySize = NULL;
+   free(list->nextOpen);
+   list->nextOpen = NULL;
+   free(list->prevOpen);
+   list->prevOpen = NULL;
 }
 
 static void attachmentListFree(AttachmentList *list)
 {
+   free(list->bySize);
+   list->bySize = NULL;
+   free(list->nextOpen);
+   list->nextOpen = NULL;
+   free(list->prevOpen);
+   list->prevOpen = NULL;
    free(list->items);
    list->items = NULL;
    list->count = 0;
    list->capacity = 0;
+   strMapFree(&list->byName);
+   if(list->dirFd >= 0)
+   {
+      close(list->dirFd);
+      list->dirFd = -1;
+   }
 }
 
 static void loadAttachmentsDir(const char *dirPath, AttachmentList *list)
@@ -145,9 +612,20 @@ static void loadAttachmentsDir(const char *dirPath, AttachmentList *list)
       exit(1);
    }
 
+   // Traced in batches of 1024 entries
+   long long batchStart = traceBegin();
+   long long batchCount = 0;
+
    struct dirent *ent;
    while((ent = readdir(dir)) != NULL)
    {
+      if(++batchCount == 1024)
+      {
+         traceEnd("scan", "readdir batch", batchStart, batchCount);
+         batchStart = traceBegin();
+         batchCount = 0;
+      }
+
       if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
       {
          continue;
@@ -171,11 +649,17 @@ static void loadAttachmentsDir(const char *dirPath, AttachmentList *list)
       snprintf(f.fileName, sizeof(f.fileName), "%s", ent->d_name);
       snprintf(f.fullPath, sizeof(f.fullPath), "%s", fullPath);
       f.fileSize = (long long)st.st_size;
+      f.mtime = (long long)st.st_mtime;
       f.used = 0;
 
       attachmentListPush(list, &f);
    }
 
+   if(batchCount > 0)
+   {
+      traceEnd("scan", "readdir batch", batchStart, batchCount);
+   }
+
    closedir(dir);
 }
 
@@ -188,11 +672,306 @@ static int utf8CharLen(unsigned char c)
    return 1;
 }
 
-static void writeLatexEscaped(FILE *out, const char *s)
+// pdfLaTeX text commands for U+00A0..U+017F (Latin-1 Supplement and Latin
+// Extended-A); NULL where T1 has no glyph
+static const char *const latinGlyphs[0x180 - 0xA0] =
+{
+   "~", "\\textexclamdown{}", "\\textcent{}", "\\pounds{}",  // U+00A0
+   "\\textcurrency{}", "\\textyen{}", "\\textbrokenbar{}", "\\S{}",  // U+00A4
+   "\\textasciidieresis{}", "\\textcopyright{}", "\\textordfeminine{}", "\\guillemotleft{}",  // U+00A8
+   "\\textlnot{}", "\\-", "\\textregistered{}", "\\textasciimacron{}",  // U+00AC
+   "\\textdegree{}", "\\textpm{}", "\\texttwosuperior{}", "\\textthreesuperior{}",  // U+00B0
+   "\\textasciiacute{}", "\\textmu{}", "\\P{}", "\\textperiodcentered{}",  // U+00B4
+   "\\c{ }", "\\textonesuperior{}", "\\textordmasculine{}", "\\guillemotright{}",  // U+00B8
+   "\\textonequarter{}", "\\textonehalf{}", "\\textthreequarters{}", "\\textquestiondown{}",  // U+00BC
+   "\\`{A}", "\\'{A}", "\\^{A}", "\\~{A}",  // U+00C0
+   "\\\"{A}", "\\AA{}", "\\AE{}", "\\c{C}",  // U+00C4
+   "\\`{E}", "\\'{E}", "\\^{E}", "\\\"{E}",  // U+00C8
+   "\\`{I}", "\\'{I}", "\\^{I}", "\\\"{I}",  // U+00CC
+   "\\DH{}", "\\~{N}", "\\`{O}", "\\'{O}",  // U+00D0
+   "\\^{O}", "\\~{O}", "\\\"{O}", "\\texttimes{}",  // U+00D4
+   "\\O{}", "\\`{U}", "\\'{U}", "\\^{U}",  // U+00D8
+   "\\\"{U}", "\\'{Y}", "\\TH{}", "\\ss{}",  // U+00DC
+   "\\`{a}", "\\'{a}", "\\^{a}", "\\~{a}",  // U+00E0
+   "\\\"{a}", "\\aa{}", "\\ae{}", "\\c{c}",  // U+00E4
+   "\\`{e}", "\\'{e}", "\\^{e}", "\\\"{e}",  // U+00E8
+   "\\`{\\i}", "\\'{\\i}", "\\^{\\i}", "\\\"{\\i}",  // U+00EC
+   "\\dh{}", "\\~{n}", "\\`{o}", "\\'{o}",  // U+00F0
+   "\\^{o}", "\\~{o}", "\\\"{o}", "\\textdiv{}",  // U+00F4
+   "\\o{}", "\\`{u}", "\\'{u}", "\\^{u}",  // U+00F8
+   "\\\"{u}", "\\'{y}", "\\th{}", "\\\"{y}",  // U+00FC
+   "\\={A}", "\\={a}", "\\u{A}", "\\u{a}",  // U+0100
+   "\\k{A}", "\\k{a}", "\\'{C}", "\\'{c}",  // U+0104
+   "\\^{C}", "\\^{c}", "\\.{C}", "\\.{c}",  // U+0108
+   "\\v{C}", "\\v{c}", "\\v{D}", "\\v{d}",  // U+010C
+   "\\DJ{}", "\\dj{}", "\\={E}", "\\={e}",  // U+0110
+   "\\u{E}", "\\u{e}", "\\.{E}", "\\.{e}",  // U+0114
+   "\\k{E}", "\\k{e}", "\\v{E}", "\\v{e}",  // U+0118
+   "\\^{G}", "\\^{g}", "\\u{G}", "\\u{g}",  // U+011C
+   "\\.{G}", "\\.{g}", "\\c{G}", "\\c{g}",  // U+0120
+   "\\^{H}", "\\^{h}", NULL, NULL,  // U+0124
+   "\\~{I}", "\\~{\\i}", "\\={I}", "\\={\\i}",  // U+0128
+   "\\u{I}", "\\u{\\i}", "\\k{I}", "\\k{i}",  // U+012C
+   "\\.{I}", "\\i{}", "\\IJ{}", "\\ij{}",  // U+0130
+   "\\^{J}", "\\^{j}", "\\c{K}", "\\c{k}",  // U+0134
+   NULL, "\\'{L}", "\\'{l}", "\\c{L}",  // U+0138
+   "\\c{l}", "\\v{L}", "\\v{l}", "L\\textperiodcentered{}",  // U+013C
+   "l\\textperiodcentered{}", "\\L{}", "\\l{}", "\\'{N}",  // U+0140
+   "\\'{n}", "\\c{N}", "\\c{n}", "\\v{N}",  // U+0144
+   "\\v{n}", "'n", "\\NG{}", "\\ng{}",  // U+0148
+   "\\={O}", "\\={o}", "\\u{O}", "\\u{o}",  // U+014C
+   "\\H{O}", "\\H{o}", "\\OE{}", "\\oe{}",  // U+0150
+   "\\'{R}", "\\'{r}", "\\c{R}", "\\c{r}",  // U+0154
+   "\\v{R}", "\\v{r}", "\\'{S}", "\\'{s}",  // U+0158
+   "\\^{S}", "\\^{s}", "\\c{S}", "\\c{s}",  // U+015C
+   "\\v{S}", "\\v{s}", "\\c{T}", "\\c{t}",  // U+0160
+   "\\v{T}", "\\v{t}", NULL, NULL,  // U+0164
+   "\\~{U}", "\\~{u}", "\\={U}", "\\={u}",  // U+0168
+   "\\u{U}", "\\u{u}", "\\r{U}", "\\r{u}",  // U+016C
+   "\\H{U}", "\\H{u}", "\\k{U}", "\\k{u}",  // U+0170
+   "\\^{W}", "\\^{w}", "\\^{Y}", "\\^{y}",  // U+0174
+   "\\\"{Y}", "\\'{Z}", "\\'{z}", "\\.{Z}",  // U+0178
+   "\\.{z}", "\\v{Z}", "\\v{z}", "s",  // U+017C
+};
+
+typedef struct
+{
+   unsigned long cp;
+   const char *latex;
+} GlyphEntry;
+
+// Other common codepoints, sorted by codepoint
+static const GlyphEntry otherGlyphs[] =
+{
+   { 0x02C6, "\\textasciicircum{}" },
+   { 0x02DC, "\\textasciitilde{}" },
+   { 0x2002, " " },
+   { 0x2003, " " },
+   { 0x2009, "\\," },
+   { 0x200A, "\\," },
+   { 0x200B, "" },
+   { 0x200C, "" },
+   { 0x200D, "" },
+   { 0x200E, "" },
+   { 0x200F, "" },
+   { 0x2010, "-" },
+   { 0x2011, "-" },
+   { 0x2012, "\\textendash{}" },
+   { 0x2013, "\\textendash{}" },
+   { 0x2014, "\\textemdash{}" },
+   { 0x2015, "\\textemdash{}" },
+   { 0x2018, "\\textquoteleft{}" },
+   { 0x2019, "\\textquoteright{}" },
+   { 0x201A, "\\quotesinglbase{}" },
+   { 0x201C, "\\textquotedblleft{}" },
+   { 0x201D, "\\textquotedblright{}" },
+   { 0x201E, "\\quotedblbase{}" },
+   { 0x2020, "\\dag{}" },
+   { 0x2021, "\\ddag{}" },
+   { 0x2022, "\\textbullet{}" },
+   { 0x2026, "\\dots{}" },
+   { 0x202F, "\\," },
+   { 0x2030, "\\textperthousand{}" },
+   { 0x2032, "$'$" },
+   { 0x2039, "\\guilsinglleft{}" },
+   { 0x203A, "\\guilsinglright{}" },
+   { 0x2044, "\\textfractionsolidus{}" },
+   { 0x20AC, "\\texteuro{}" },
+   { 0x2116, "\\textnumero{}" },
+   { 0x2122, "\\texttrademark{}" },
+   { 0x2190, "\\textleftarrow{}" },
+   { 0x2191, "\\textuparrow{}" },
+   { 0x2192, "\\textrightarrow{}" },
+   { 0x2193, "\\textdownarrow{}" },
+   { 0x2212, "\\textminus{}" },
+   { 0x221E, "$\\infty$" },
+   { 0x2260, "$\\neq$" },
+   { 0x2264, "$\\leq$" },
+   { 0x2265, "$\\geq$" },
+   { 0xFE0E, "" },
+   { 0xFE0F, "" },
+   { 0xFEFF, "" }
+};
+
+static unsigned long utf8Decode(const unsigned char *p, int len)
+{
+   static const unsigned char leadMask[5] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+   unsigned long cp = p[0] & leadMask[len];
+   for(int i = 1; i < len; i++)
+   {
+      if((p[i] & 0xC0) != 0x80)
+      {
+         return 0xFFFD;
+      }
+      cp = (cp << 6) | (p[i] & 0x3F);
+   }
+   return cp;
+}
+
+static const char *lookupGlyph(unsigned long cp)
+{
+   if(cp >= 0xA0 && cp < 0x180)
+   {
+      return latinGlyphs[cp - 0xA0];
+   }
+
+   size_t lo = 0;
+   size_t hi = sizeof(otherGlyphs) / sizeof(otherGlyphs[0]);
+   while(lo < hi)
+   {
+      size_t mid = (lo + hi) / 2;
+      if(otherGlyphs[mid].cp < cp)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   if(lo < sizeof(otherGlyphs) / sizeof(otherGlyphs[0]) && otherGlyphs[lo].cp == cp)
+   {
+      return otherGlyphs[lo].latex;
+   }
+   return NULL;
+}
+
+static int isEmojiJoiner(unsigned long cp)
+{
+   // Codepoints that extend the preceding emoji
+   return cp == 0xFE0F || cp == 0xFE0E || cp == 0x20E3 ||
+          (cp >= 0x1F3FB && cp <= 0x1F3FF) ||
+          (cp >= 0xE0020 && cp <= 0xE007F);
+}
+
+static int findEmojiImage(const DocumentOptions *doc, const unsigned long *cps, int n, char *outPath, size_t outCap)
+{
+   // Tries Twemoji ("1f44d-1f3fb.png") and Noto ("emoji_u1f44d_1f3fb.png")
+   // names, with and without variation selectors. Results are cached by name.
+   char twemoji[256];
+   char plain[256];
+   char noto[256];
+   size_t t = 0;
+   size_t pl = 0;
+   size_t no = 0;
+   for(int i = 0; i < n; i++)
+   {
+      t += (size_t)snprintf(twemoji + t, sizeof(twemoji) - t, "%s%lx", i ? "-" : "", cps[i]);
+      if(cps[i] != 0xFE0F)
+      {
+         pl += (size_t)snprintf(plain + pl, sizeof(plain) - pl, "%s%lx", pl ? "-" : "", cps[i]);
+         no += (size_t)snprintf(noto + no, sizeof(noto) - no, "%s%04lx", no ? "_" : "", cps[i]);
+      }
+   }
+
+   long long *cached = strMapFind(doc->emojiCache, twemoji);
+   int variant = cached ? (int)*cached : 0;
+   if(!cached)
+   {
+      struct stat st;
+      snprintf(outPath, outCap, "%s/%s.png", doc->emojiDir, twemoji);
+      if(stat(outPath, &st) == 0)
+      {
+         variant = 1;
+      }
+      else
+      {
+         snprintf(outPath, outCap, "%s/%s.png", doc->emojiDir, plain);
+         if(stat(outPath, &st) == 0)
+         {
+            variant = 2;
+         }
+         else
+         {
+            snprintf(outPath, outCap, "%s/emoji_u%s.png", doc->emojiDir, noto);
+            variant = (stat(outPath, &st) == 0) ? 3 : -1;
+         }
+      }
+      strMapInsert(doc->emojiCache, twemoji, variant);
+   }
+
+   switch(variant)
+   {
+      case 1: snprintf(outPath, outCap, "%s/%s.png", doc->emojiDir, twemoji); return 1;
+      case 2: snprintf(outPath, outCap, "%s/%s.png", doc->emojiDir, plain); return 1;
+      case 3: snprintf(outPath, outCap, "%s/emoji_u%s.png", doc->emojiDir, noto); return 1;
+      default: return 0;
+   }
+}
+
+static size_t writePdfLatexGlyph(FILE *out, const DocumentOptions *doc, const unsigned char *p, const unsigned char *end)
+{
+   // Writes the non-ASCII character (or emoji sequence) at p; returns bytes consumed
+   int len = utf8CharLen(*p);
+   if(len > end - p)
+   {
+      len = (int)(end - p);
+   }
+   unsigned long cp = (len > 1) ? utf8Decode(p, len) : 0xFFFD;
+
+   const char *glyph = lookupGlyph(cp);
+   if(glyph)
+   {
+      fputs(glyph, out);
+      return (size_t)len;
+   }
+
+   // Collect the whole emoji sequence: modifiers, ZWJ joins, flag pairs
+   unsigned long cps[16];
+   int n = 0;
+   size_t used = (size_t)len;
+   cps[n++] = cp;
+   int flag = (cp >= 0x1F1E6 && cp <= 0x1F1FF);
+   while(p + used < end && n < 15)
+   {
+      int nextLen = utf8CharLen(p[used]);
+      if(nextLen < 2 || p + used + nextLen > end)
+      {
+         break;
+      }
+      unsigned long next = utf8Decode(p + used, nextLen);
+      if(isEmojiJoiner(next) || (flag && n == 1 && next >= 0x1F1E6 && next <= 0x1F1FF))
+      {
+         cps[n++] = next;
+         used += (size_t)nextLen;
+      }
+      else if(next == 0x200D && p + used + nextLen < end)
+      {
+         int joinedLen = utf8CharLen(p[used + nextLen]);
+         if(joinedLen < 2 || p + used + nextLen + joinedLen > end)
+         {
+            break;
+         }
+         cps[n++] = next;
+         cps[n++] = utf8Decode(p + used + nextLen, joinedLen);
+         used += (size_t)(nextLen + joinedLen);
+      }
+      else
+      {
+         break;
+      }
+   }
+
+   char path[MaxPathLen];
+   if(doc->emojiDir && (findEmojiImage(doc, cps, n, path, sizeof(path)) || findEmojiImage(doc, cps, 1, path, sizeof(path))))
+   {
+      fputs("\\emojiimg{\\detokenize{", out);
+      fputs(path, out);
+      fputs("}}", out);
+   }
+   else
+   {
+      fprintf(out, "\\missingglyph{%04lX}", cp);
+   }
+   return used;
+}
+
+static void writeLatexEscapedLen(FILE *out, const DocumentOptions *doc, const char *s, size_t n)
 {
    const unsigned char *p = (const unsigned char *)s;
+   const unsigned char *end = p + n;
 
-   while(*p)
+   while(p < end)
    {
       if(*p < 0x80)
       {
@@ -214,9 +993,17 @@ static void writeLatexEscaped(FILE *out, const char *s)
          }
          p++;
       }
+      else if(doc->engine == EnginePdfLatex)
+      {
+         p += writePdfLatexGlyph(out, doc, p, end);
+      }
       else
       {
          int len = utf8CharLen(*p);
+         if(len > end - p)
+         {
+            len = (int)(end - p);
+         }
 
          fputs("\\emoji{", out);
          fwrite(p, 1, len, out);
@@ -227,6 +1014,33 @@ static void writeLatexEscaped(FILE *out, const char *s)
    }
 }
 
+static void writeLatexEscaped(FILE *out, const DocumentOptions *doc, const char *s)
+{
+   writeLatexEscapedLen(out, doc, s, strlen(s));
+}
+
+static void writeHtmlEscapedLen(FILE *out, const char *s, size_t n)
+{
+   // UTF-8 passes through unchanged; only markup characters become entities
+   size_t run = 0;
+   for(size_t i = 0; i < n; i++)
+   {
+      const char *entity;
+      switch(s[i])
+      {
+         case '&': entity = "&amp;"; break;
+         case '<': entity = "&lt;"; break;
+         case '>': entity = "&gt;"; break;
+         case '"': entity = "&quot;"; break;
+         default: continue;
+      }
+      fwrite(s + run, 1, i - run, out);
+      fputs(entity, out);
+      run = i + 1;
+   }
+   fwrite(s + run, 1, n - run, out);
+}
+
 static void trimRight(char *s)
 {
    size_t n = strlen(s);
@@ -332,73 +1146,470 @@ static void parseAttachmentLine(const char *line, char *outName, size_t outNameC
    }
 }
 
-static int isImageMime(const char *mime)
-{
-   return (mime && startsWith(mime, "image/"));
-}
+// Lazy attachment loading: named references are looked up with fstatat as
+// they come, which for a short conversation is much cheaper than listing a
+// large directory. The directory is listed on the first lookup by size (a
+// reference without a name, or whose named file is missing or taken), or
+// once LazyProbeMax names have been probed.
+#define LazyProbeMax 256
 
-static int findAttachmentByExactName(AttachmentList *list, const char *name)
+static void completeAttachments(AttachmentList *list)
 {
+   // Replaces the probed files by the full listing, in directory order like
+   // a list loaded up front, keeping their used and reserved marks
+   if(list->listed)
+   {
+      return;
+   }
+   AttachmentList all;
+   attachmentListInit(&all);
+   loadAttachmentsDir(list->dirPath, &all);
    for(size_t i = 0; i < list->count; i++)
    {
-      if(list->items[i].used)
-      {
-         continue;
-      }
-      if(strcmp(list->items[i].fileName, name) == 0)
+      long long *idx = strMapFind(&all.byName, list->items[i].fileName);
+      if(idx)
       {
-         return (int)i;
+         all.items[*idx].used = list->items[i].used;
+         all.items[*idx].reserved = list->items[i].reserved;
       }
    }
-   return -1;
+   attachmentListFree(list);
+   *list = all;
 }
 
-static int findAttachmentBySize(AttachmentList *list, long long size, int preferImage)
+static int findAttachmentFile(AttachmentList *list, const char *name)
 {
-   int bestIdx = -1;
+   // Index of the file with this name, used or not, probing it if the
+   // directory is not listed yet; -1 if there is none
+   long long *idx = strMapFind(&list->byName, name);
+   if(idx || list->listed)
+   {
+      return idx ? (int)*idx : -1;
+   }
+   if(strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+   {
+      return -1;   // Not a directory entry
+   }
+   if(list->probes == LazyProbeMax)
+   {
+      completeAttachments(list);
+      idx = strMapFind(&list->byName, name);
+      return idx ? (int)*idx : -1;
+   }
+
+   list->probes++;
+   struct stat st;
+   if(fstatat(list->dirFd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+   {
+      return -1;
+   }
+   AttachmentFile f;
+   memset(&f, 0, sizeof(f));
+   snprintf(f.fileName, sizeof(f.fileName), "%s", name);
+   snprintf(f.fullPath, sizeof(f.fullPath), "%s/%s", list->dirPath, name);
+   f.fileSize = (long long)st.st_size;
+   f.mtime = (long long)st.st_mtime;
+   attachmentListPush(list, &f);
+   return (int)list->count - 1;
+}
+
+static int isImageMime(const char *mime)
+{
+   return (mime && startsWith(mime, "image/"));
+}
 
-   // First pass: exact size and preferred image-ness if requested
-   if(preferImage)
+static int findAttachmentByExactName(AttachmentList *list, const char *name)
+{
+   int idx = findAttachmentFile(list, name);
+   return (idx >= 0 && !list->items[idx].used) ? idx : -1;
+}
+
+static const AttachmentList *sizeOrderList;   // qsort context
+
+static int compareBySize(const void *a, const void *b)
+{
+   size_t ia = *(const size_t *)a;
+   size_t ib = *(const size_t *)b;
+   long long sa = sizeOrderList->items[ia].fileSize;
+   long long sb = sizeOrderList->items[ib].fileSize;
+   if(sa != sb)
+   {
+      return (sa < sb) ? -1 : 1;
+   }
+   return (ia < ib) ? -1 : (ia > ib);
+}
+
+static size_t sizeIndexLowerBound(AttachmentList *list, long long size)
+{
+   // First position in the size index whose file is at least size bytes
+   if(!list->bySize)
    {
+      list->bySize = (size_t *)malloc((list->count + 1) * sizeof(size_t));
+      if(!list->bySize)
+      {
+         fatal("Out of memory building attachment size index");
+      }
       for(size_t i = 0; i < list->count; i++)
       {
-         if(list->items[i].used)
+         list->bySize[i] = i;
+      }
+      sizeOrderList = list;
+      qsort(list->bySize, list->count, sizeof(size_t), compareBySize);
+   }
+
+   size_t lo = 0;
+   size_t hi = list->count;
+   while(lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      if(list->items[list->bySize[mid]].fileSize < size)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+static int findAttachmentBySize(AttachmentList *list, long long size, int preferImage)
+{
+   // Equal sizes are kept in list order, so this picks what a linear scan would
+   completeAttachments(list);
+   size_t first = sizeIndexLowerBound(list, size);
+   int bestIdx = -1;
+
+   for(size_t k = first; k < list->count; k++)
+   {
+      const AttachmentFile *f = &list->items[list->bySize[k]];
+      if(f->fileSize != size)
+      {
+         break;
+      }
+      if(f->used)
+      {
+         continue;
+      }
+      if(bestIdx < 0)
+      {
+         bestIdx = (int)list->bySize[k];
+         if(!preferImage)
          {
-            continue;
+            break;
+         }
+      }
+      if(preferImage && hasImageExtension(f->fileName))
+      {
+         return (int)list->bySize[k];
+      }
+   }
+
+   return bestIdx;
+}
+
+static int mimeAgreement(const char *mime, const char *fileName)
+{
+   // 2 if the MIME subtype names the file extension, 1 if both are images, else 0
+   const char *slash = mime ? strchr(mime, '/') : NULL;
+   const char *dot = strrchr(fileName, '.');
+   if(!slash || !dot)
+   {
+      return 0;
+   }
+   const char *subtype = slash + 1;
+   const char *ext = dot + 1;
+   if(strcasecmp(subtype, ext) == 0 ||
+      (strcasecmp(subtype, "jpeg") == 0 && strcasecmp(ext, "jpg") == 0) ||
+      (strcasecmp(subtype, "tiff") == 0 && strcasecmp(ext, "tif") == 0) ||
+      (strcasecmp(subtype, "quicktime") == 0 && strcasecmp(ext, "mov") == 0))
+   {
+      return 2;
+   }
+   return (isImageMime(mime) && hasImageExtension(fileName)) ? 1 : 0;
+}
+
+static size_t openSlot(const AttachmentList *list, size_t *link, size_t slot, int down)
+{
+   // Union-find over size index slots: follows link from slot to the first
+   // slot whose file is neither used nor reserved, and points the slots passed
+   // on the way straight at it (files never become available again). Upwards
+   // slot k is position k and slot count the end; downwards slot k is
+   // position k - 1 and slot 0 the end
+   size_t end = down ? 0 : list->count;
+   size_t root = slot;
+   for(;;)
+   {
+      while(root != end && link[root] != root)
+      {
+         root = link[root];
+      }
+      if(root == end)
+      {
+         break;
+      }
+      const AttachmentFile *f = &list->items[list->bySize[down ? root - 1 : root]];
+      if(!f->used && !f->reserved)
+      {
+         break;
+      }
+      link[root] = down ? root - 1 : root + 1;
+   }
+   while(slot != root)
+   {
+      size_t next = link[slot];
+      link[slot] = root;
+      slot = next;
+   }
+   return root;
+}
+
+static int findAttachmentNearSize(AttachmentList *list, long long size, long long tolerance, const char *mime, long long sentTime)
+{
+   // Closest unused, unreserved size within the tolerance; ties go to the
+   // file whose type agrees with the MIME type, then to the modification time
+   // closest to the message's sent time (sigtop att -m sets it), then to list
+   // order. Walks outwards from size in both directions, skipping taken files
+   // and stopping past the best distance, so a lookup costs the binary search
+   // plus the open files at the closest distance
+   completeAttachments(list);
+   size_t mid = sizeIndexLowerBound(list, size);
+   if(!list->nextOpen)
+   {
+      list->nextOpen = (size_t *)malloc((list->count + 1) * sizeof(size_t));
+      list->prevOpen = (size_t *)malloc((list->count + 1) * sizeof(size_t));
+      if(!list->nextOpen || !list->prevOpen)
+      {
+         fatal("Out of memory building attachment size index");
+      }
+      for(size_t i = 0; i <= list->count; i++)
+      {
+         list->nextOpen[i] = i;
+         list->prevOpen[i] = i;
+      }
+   }
+   int bestIdx = -1;
+   long long bestDiff = 0;
+   int bestAgree = 0;
+   long long bestTime = 0;
+
+   for(int down = 0; down <= 1; down++)
+   {
+      size_t *link = down ? list->prevOpen : list->nextOpen;
+      size_t end = down ? 0 : list->count;
+      for(size_t slot = openSlot(list, link, mid, down); slot != end;
+          slot = openSlot(list, link, down ? slot - 1 : slot + 1, down))
+      {
+         size_t idx = list->bySize[down ? slot - 1 : slot];
+         const AttachmentFile *f = &list->items[idx];
+         long long diff = llabs(f->fileSize - size);
+         if(diff > tolerance || (bestIdx >= 0 && diff > bestDiff))
+         {
+            break;
          }
-         if(list->items[i].fileSize == size && hasImageExtension(list->items[i].fileName))
+
+         int agree = mimeAgreement(mime, f->fileName);
+         long long timeDist = (sentTime >= 0) ? llabs(f->mtime - sentTime) : 0;
+         if(bestIdx < 0 || diff < bestDiff ||
+            (diff == bestDiff && (agree > bestAgree ||
+            (agree == bestAgree && (timeDist < bestTime || (timeDist == bestTime && (int)idx < bestIdx))))))
          {
-            return (int)i;
+            bestIdx = (int)idx;
+            bestDiff = diff;
+            bestAgree = agree;
+            bestTime = timeDist;
          }
       }
    }
+   return bestIdx;
+}
 
-   // Second pass: any file with matching size
-   for(size_t i = 0; i < list->count; i++)
+static void loadAttachments(const char *dirPath, AttachmentList *list, const char *prescanPath, long long start)
+{
+   // Opens the directory for lazy lookups. With --size-tolerance, approximate
+   // matches are resolved after all exact ones: prescanPath is then read from
+   // byte start on, and every file that a reference there matches by name or
+   // exact size is marked reserved, which findAttachmentNearSize leaves
+   // alone. Exact matching never takes an unreserved file in place of a
+   // reserved one, so the conversion pairs them up the same way
+   list->dirFd = open(dirPath, O_RDONLY | O_DIRECTORY);
+   if(list->dirFd < 0)
+   {
+      fprintf(stderr, "Error: could not open attachments directory '%s': %s\n", dirPath, strerror(errno));
+      exit(1);
+   }
+   list->dirPath = dirPath;
+   list->listed = 0;
+
+   FILE *in = prescanPath ? fopen(prescanPath, "rb") : NULL;
+   if(!in)
+   {
+      return;
+   }
+   if(start > 0)
    {
-      if(list->items[i].used)
+      fseeko(in, (off_t)start, SEEK_SET);
+   }
+
+   long long prescanStart = traceBegin();
+   long long refs = 0;
+   char line[8192];
+   while(fgets(line, (int)sizeof(line), in))
+   {
+      if(!startsWith(line, "Attachment:"))
       {
          continue;
       }
-      if(list->items[i].fileSize == size)
+      trimRight(line);
+
+      char attName[MaxPathLen];
+      char attMime[128];
+      long long attBytes = -1;
+      int hasName = 0;
+      parseAttachmentLine(line, attName, sizeof(attName), attMime, sizeof(attMime), &attBytes, &hasName);
+      int idx = hasName ? findAttachmentByExactName(list, attName) : -1;
+      if(idx < 0 && attBytes >= 0)
       {
-         bestIdx = (int)i;
-         break;
+         idx = findAttachmentBySize(list, attBytes, isImageMime(attMime));
       }
+      if(idx >= 0)
+      {
+         list->items[idx].used = 1;
+      }
+      refs++;
    }
+   fclose(in);
+   traceEnd("scan", "prescan", prescanStart, refs);
 
-   return bestIdx;
+   for(size_t i = 0; i < list->count; i++)
+   {
+      list->items[i].reserved = list->items[i].used;
+      list->items[i].used = 0;
+   }
+}
+
+static unsigned long readBE32(const unsigned char *p)
+{
+   return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) | ((unsigned long)p[2] << 8) | (unsigned long)p[3];
+}
+
+static unsigned long readLE32(const unsigned char *p)
+{
+   return ((unsigned long)p[3] << 24) | ((unsigned long)p[2] << 16) | ((unsigned long)p[1] << 8) | (unsigned long)p[0];
+}
+
+static int readImageSize(const char *path, long *outWidth, long *outHeight)
+{
+   // Reads pixel dimensions from the image header only (PNG, JPEG, GIF, BMP)
+   long long traceStart = traceBegin();
+   FILE *f = fopen(path, "rb");
+   if(!f)
+   {
+      return 0;
+   }
+
+   unsigned char hdr[32];
+   size_t n = fread(hdr, 1, sizeof(hdr), f);
+   int ok = 0;
+
+   if(n >= 24 && memcmp(hdr, "\x89PNG\r\n\x1a\n", 8) == 0)
+   {
+      *outWidth = (long)readBE32(hdr + 16);
+      *outHeight = (long)readBE32(hdr + 20);
+      ok = 1;
+   }
+   else if(n >= 10 && memcmp(hdr, "GIF8", 4) == 0)
+   {
+      *outWidth = (long)(hdr[6] | (hdr[7] << 8));
+      *outHeight = (long)(hdr[8] | (hdr[9] << 8));
+      ok = 1;
+   }
+   else if(n >= 26 && hdr[0] == 'B' && hdr[1] == 'M')
+   {
+      long h = (long)(int)readLE32(hdr + 22);
+      *outWidth = (long)(int)readLE32(hdr + 18);
+      *outHeight = (h < 0) ? -h : h;
+      ok = 1;
+   }
+   else if(n >= 4 && hdr[0] == 0xFF && hdr[1] == 0xD8)
+   {
+      // Walk the JPEG segments up to the first start-of-frame marker
+      long pos = 2;
+      unsigned char seg[9];
+      while(fseek(f, pos, SEEK_SET) == 0 && fread(seg, 1, 4, f) == 4)
+      {
+         if(seg[0] != 0xFF)
+         {
+            break;
+         }
+         if(seg[1] == 0xFF)
+         {
+            pos++;
+            continue;
+         }
+         int marker = seg[1];
+         long segLen = (seg[2] << 8) | seg[3];
+         if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+         {
+            if(fread(seg + 4, 1, 5, f) == 5)
+            {
+               *outHeight = (long)((seg[5] << 8) | seg[6]);
+               *outWidth = (long)((seg[7] << 8) | seg[8]);
+               ok = 1;
+            }
+            break;
+         }
+         if(marker == 0xD9 || marker == 0xDA || segLen < 2)
+         {
+            break;
+         }
+         pos += 2 + segLen;
+      }
+   }
+
+   fclose(f);
+   traceEnd("attachment", "image header", traceStart, -1);
+   return ok && *outWidth > 0 && *outHeight > 0;
 }
 
-static void writeImageInclude(FILE *out, const char *relPath)
+static void writeImageIncludeSized(FILE *out, const char *relPath, long w, long h)
 {
+   // Writes a proof frame when the image dimensions are given (w, h > 0), the image otherwise
    fputs("\n\\par\\noindent\n", out);
-   fputs("\\includegraphics[width=\\linewidth,height=0.9\\textheight,keepaspectratio]{\\detokenize{", out);
-   fputs(relPath, out);
-   fputs("}}\n", out);
+   if(w > 0 && h > 0)
+   {
+      // Empty frame of the size \includegraphics would produce (see writePreamble)
+      double ratio = (double)h / (double)w;
+      if(ratio > 30.0)
+      {
+         ratio = 30.0;
+      }
+      fprintf(out, "\\proofimage{%.5f}{%ld}{%ld}{\\detokenize{", ratio, w, h);
+      fputs(relPath, out);
+      fputs("}}\n", out);
+   }
+   else
+   {
+      fputs("\\includegraphics[width=\\linewidth,height=0.9\\textheight,keepaspectratio]{\\detokenize{", out);
+      fputs(relPath, out);
+      fputs("}}\n", out);
+   }
    fputs("\\par\\medskip\n\n", out);
 }
 
+static void writeImageInclude(FILE *out, const char *relPath, const char *fullPath, int proof)
+{
+   long w = 0;
+   long h = 0;
+   if(!proof || !readImageSize(fullPath, &w, &h))
+   {
+      w = 0;
+      h = 0;
+   }
+   writeImageIncludeSized(out, relPath, w, h);
+}
+
 static void writeNonImageAttachment(FILE *out, const char *relPath)
 {
    fputs("\n\\begin{quote}\n", out);
@@ -441,173 +1652,5769 @@ static void stripPhoneFromFromLine(char *line)
    trimRight(line);
 }
 
-int main(int argc, char *argv[])
+
+// Layout of the generated document (A4, 25mm margins, 11pt article), used to
+// estimate how many pages a message range will occupy once typeset.
+#define EstTextWidthPt 455.0
+#define EstTextHeightPt 702.0
+#define EstBaselinePt 13.6
+#define EstCharsPerLine 85.0
+#define EstLinesPerPage (EstTextHeightPt / EstBaselinePt)
+
+typedef struct
+{
+   long long outOffset;   // Offset of the message's first byte in the .tex output
+   long long inputLine;   // Line number of the message's first line in the input
+   double pages;          // Estimated number of typeset pages
+} MessageMark;
+
+typedef struct
+{
+   MessageMark *items;
+   size_t count;
+   size_t capacity;
+} MessageMarkList;
+
+static void messageMarkListInit(MessageMarkList *list)
+{
+   list->items = NULL;
+   list->count = 0;
+   list->capacity = 0;
+}
+
+static void messageMarkListPush(MessageMarkList *list, long long outOffset, long long inputLine)
 {
-   if(argc < 2)
+   // A message that produced no output shares its offset with the next one,
+   // which then owns the mark
+   if(list->count > 0 && list->items[list->count - 1].outOffset == outOffset)
    {
-      fprintf(stderr, "Usage: %s <input_file>\n", argv[0]);
-      return 1;
+      list->items[list->count - 1].inputLine = inputLine;
+      return;
    }
 
-   const char *inputPath = argv[1];
-
-   // Generate output filename by replacing extension with .tex
-   char outputPath[MaxPathLen];
-   const char *lastDot = strrchr(inputPath, '.');
-   if(lastDot && lastDot != inputPath)
+   if(list->count >= list->capacity)
    {
-      size_t baseLen = (size_t)(lastDot - inputPath);
-      if(baseLen >= sizeof(outputPath))
+      size_t newCap = (list->capacity == 0) ? 1024 : (list->capacity * 2);
+      MessageMark *newItems = (MessageMark *)realloc(list->items, newCap * sizeof(MessageMark));
+      if(!newItems)
       {
-         baseLen = sizeof(outputPath) - 5;  // Leave room for ".tex\0"
+         fatal("Out of memory reallocating message list");
       }
-      memcpy(outputPath, inputPath, baseLen);
-      outputPath[baseLen] = '\0';
-      strcat(outputPath, ".tex");
-   }
-   else
-   {
-      snprintf(outputPath, sizeof(outputPath), "%s.tex", inputPath);
+      list->items = newItems;
+      list->capacity = newCap;
    }
+   list->items[list->count].outOffset = outOffset;
+   list->items[list->count].inputLine = inputLine;
+   list->items[list->count].pages = 0.0;
+   list->count++;
+}
 
-   const char *attachmentsDir = "./attachments";
+static void messageMarkListFree(MessageMarkList *list)
+{
+   free(list->items);
+   list->items = NULL;
+   list->count = 0;
+   list->capacity = 0;
+}
 
-   AttachmentList list;
-   attachmentListInit(&list);
-   loadAttachmentsDir(attachmentsDir, &list);
+typedef struct
+{
+   long long outStart;    // Output range of an attachment block
+   long long outEnd;
+   long long inputLine;
+   char *label;           // Attachment path, or the line of an unmatched reference
+   char *file;            // File the block includes with \includegraphics, or NULL
+} AttachmentMark;
 
-   FILE *in = fopen(inputPath, "rb");
-   if(!in)
+typedef struct
+{
+   AttachmentMark *items;
+   size_t count;
+   size_t capacity;
+} AttachmentMarkList;
+
+static void attachmentMarkListPush(AttachmentMarkList *list, long long outStart, long long outEnd, long long inputLine, const char *label, const char *file)
+{
+   if(list->count >= list->capacity)
    {
-      fprintf(stderr, "Error: could not open '%s': %s\n", inputPath, strerror(errno));
-      attachmentListFree(&list);
-      return 1;
+      size_t newCap = (list->capacity == 0) ? 256 : (list->capacity * 2);
+      AttachmentMark *newItems = (AttachmentMark *)realloc(list->items, newCap * sizeof(AttachmentMark));
+      if(!newItems)
+      {
+         fatal("Out of memory reallocating attachment mark list");
+      }
+      list->items = newItems;
+      list->capacity = newCap;
+   }
+   AttachmentMark *m = &list->items[list->count++];
+   m->outStart = outStart;
+   m->outEnd = outEnd;
+   m->inputLine = inputLine;
+   m->label = strdup(label);
+   m->file = file ? strdup(file) : NULL;
+   if(!m->label || (file && !m->file))
+   {
+      fatal("Out of memory copying attachment label");
    }
+}
 
-   FILE *out = fopen(outputPath, "wb");
-   if(!out)
+static void attachmentMarkListFree(AttachmentMarkList *list)
+{
+   for(size_t i = 0; i < list->count; i++)
    {
-      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", outputPath, strerror(errno));
-      fclose(in);
-      attachmentListFree(&list);
-      return 1;
+      free(list->items[i].label);
+      free(list->items[i].file);
    }
+   free(list->items);
+   list->items = NULL;
+   list->count = 0;
+   list->capacity = 0;
+}
 
-   // Minimal LaTeX wrapper
-   fputs("\\documentclass[a4paper,11pt]{article}\n", out);
-   fputs("\\usepackage[margin=25mm]{geometry}\n", out);
-   fputs("\\usepackage{graphicx}\n", out);
-   // For pdfLaTeX compilation only:
-   // fputs("\\usepackage[T1]{fontenc}\n", out);
-   // fputs("\\usepackage[utf8]{inputenc}\n", out);
-   // fputs("\\usepackage{lmodern}\n", out);
+// Line classification. The rules are bucketed by case-folded first byte; a
+// candidate is checked with one masked compare of the first 8 bytes loaded as
+// a word, and only prefixes longer than that compare their remaining bytes.
+// New line kinds need only a rule here.
+enum
+{
+   LineText,
+   LineConversation,
+   LineType,
+   LineFrom,
+   LineSent,
+   LineReceived,
+   LineAttachment,
+   LineQuote,
+   LineReaction,
+   LineKindCount
+};
 
-   fputs("\\usepackage{fontspec}\n", out);
-   fputs("\\setmainfont{Latin Modern Roman}\n", out);
+enum
+{
+   LineStart = 1,     // Starts a message unless it follows another header line
+   LineHeader = 2,    // Belongs to the message header
+   LineSkipped = 4    // Metadata left out of the document
+};
 
-   // Emoji font 
-   // Linux:
-   // fputs("\\newfontfamily\\emojifont{Noto Color Emoji}\n", out);
-   // Windows:
-   fputs("\\newfontfamily\\emojifont{Segoe UI Emoji}\n", out);
+typedef struct
+{
+   const char *prefix;
+   int flags;
+   int foldCase;      // Compare ASCII letters case-insensitively
+   size_t len;        // Filled in by lineRulesInit
+   uint64_t word;     // First bytes of the prefix, letters folded to lower case
+   uint64_t mask;     // Bytes of word that take part in the compare
+   uint64_t fold;     // 0x20 in every case-insensitive letter byte
+} LineRule;
 
-   fputs("\\DeclareTextFontCommand{\\emoji}{\\emojifont}\n", out);
-   // fputs("\\usepackage{ragged2e}\n", out);
-   // fputs("\\AtBeginDocument{\\RaggedRight}\n", out);
-   fputs("\\setlength{\\emergencystretch}{3em}\n", out);
-   fputs("\\begin{document}\n\n", out);
+static LineRule lineRules[LineKindCount] =
+{
+   [LineText]         = { NULL, 0, 0 },
+   [LineConversation] = { "Conversation:", LineStart | LineHeader, 1 },
+   [LineType]         = { "Type:", LineStart | LineHeader | LineSkipped, 1 },
+   [LineFrom]         = { "From:", LineStart | LineHeader, 1 },
+   [LineSent]         = { "Sent:", LineHeader, 1 },
+   [LineReceived]     = { "Received:", LineHeader | LineSkipped, 1 },
+   [LineAttachment]   = { "Attachment:", 0, 0 },
+   [LineQuote]        = { "Quote:", 0, 1 },
+   [LineReaction]     = { "Reaction:", 0, 1 },
+};
 
-   char line[8192];
-   while(fgets(line, (int)sizeof(line), in))
+static unsigned char lineBuckets[256][LineKindCount];   // Candidate kinds by first byte, 0-terminated
+
+static void lineRuleAddToBucket(unsigned char first, int kind)
+{
+   unsigned char *bucket = lineBuckets[first];
+   while(*bucket)
    {
-      // Remove trailing newline/space early
-      trimRight(line);
+      bucket++;
+   }
+   *bucket = (unsigned char)kind;
+}
+
+static void lineRulesInit(void)
+{
+   memset(lineBuckets, 0, sizeof(lineBuckets));
+   for(int kind = LineText + 1; kind < LineKindCount; kind++)
+   {
+      LineRule *r = &lineRules[kind];
+      unsigned char word[8] = { 0 };
+      unsigned char mask[8] = { 0 };
+      unsigned char fold[8] = { 0 };
 
-      // Suppress unwanted metadata lines
-      if(startsWithIgnoreCase(line, "Type:"))
+      r->len = strlen(r->prefix);
+      for(size_t i = 0; i < r->len && i < 8; i++)
       {
-         continue;
+         unsigned char c = (unsigned char)r->prefix[i];
+         if(r->foldCase && isalpha(c))
+         {
+            c |= 0x20;
+            fold[i] = 0x20;
+         }
+         word[i] = c;
+         mask[i] = 0xFF;
       }
+      memcpy(&r->word, word, 8);
+      memcpy(&r->mask, mask, 8);
+      memcpy(&r->fold, fold, 8);
+
+      unsigned char first = (unsigned char)r->prefix[0];
+      lineRuleAddToBucket(first, kind);
+      if(r->foldCase && isalpha(first))
+      {
+         lineRuleAddToBucket(first ^ 0x20, kind);
+      }
+   }
+}
+
+static int classifyLine(const char *line)
+{
+   const unsigned char *bucket = lineBuckets[(unsigned char)line[0]];
+   if(!bucket[0])
+   {
+      return LineText;
+   }
+
+   // OR-ing 0x20 only maps letters onto lower-case letters, so folding is exact
+   unsigned char bytes[8] = { 0 };
+   memcpy(bytes, line, strnlen(line, 8));
+   uint64_t word;
+   memcpy(&word, bytes, 8);
 
-      if(startsWithIgnoreCase(line, "Received:"))
+   for(; *bucket; bucket++)
+   {
+      const LineRule *r = &lineRules[*bucket];
+      if(((word | r->fold) & r->mask) != r->word)
       {
          continue;
       }
+      if(r->len <= 8 ||
+         (r->foldCase ? startsWithIgnoreCase(line + 8, r->prefix + 8) : startsWith(line + 8, r->prefix + 8)))
+      {
+         return *bucket;
+      }
+   }
+   return LineText;
+}
 
-      if(startsWithIgnoreCase(line, "From:"))
+static double estimateTextLines(const char *s)
+{
+   // Count UTF-8 characters rather than bytes
+   size_t chars = 0;
+   for(const unsigned char *p = (const unsigned char *)s; *p; p++)
+   {
+      if((*p & 0xC0) != 0x80)
       {
-         stripPhoneFromFromLine(line);
+         chars++;
       }
+   }
+   if(chars == 0)
+   {
+      return 1.0;
+   }
+   long lines = (long)(chars / EstCharsPerLine);
+   if(lines * EstCharsPerLine < chars)
+   {
+      lines++;
+   }
+   return (double)lines;
+}
 
-      // Keep original newline behaviour: we escape content but preserve line breaks
-      if(startsWith(line, "Attachment:"))
+static double estimateImageLines(const char *fullPath)
+{
+   // Mirrors writeImageInclude: full line width, at most 0.9\textheight
+   long w = 0;
+   long h = 0;
+   double heightPt = 0.9 * EstTextHeightPt;
+   if(readImageSize(fullPath, &w, &h))
+   {
+      double scaled = EstTextWidthPt * (double)h / (double)w;
+      if(scaled < heightPt)
       {
-         char attName[MaxPathLen];
-         char attMime[128];
-         long long attBytes = -1;
-         int hasName = 0;
+         heightPt = scaled;
+      }
+   }
+   return heightPt / EstBaselinePt + 2.0;
+}
 
-         parseAttachmentLine(line, attName, sizeof(attName), attMime, sizeof(attMime), &attBytes, &hasName);
+static int readWholeFile(const char *path, char **outData, size_t *outSize)
+{
+   // The buffer is NUL-terminated so it can be scanned with string functions
+   FILE *f = fopen(path, "rb");
+   if(!f)
+   {
+      return 0;
+   }
+   if(fseeko(f, 0, SEEK_END) != 0)
+   {
+      fclose(f);
+      return 0;
+   }
+   long long size = (long long)ftello(f);
+   rewind(f);
 
-         int idx = -1;
-         if(hasName)
-         {
-            idx = findAttachmentByExactName(&list, attName);
-         }
-         if(idx < 0 && attBytes >= 0)
+   char *data = (char *)malloc((size_t)size + 1);
+   if(!data)
+   {
+      fatal("Out of memory reading file");
+   }
+   if(size > 0 && fread(data, 1, (size_t)size, f) != (size_t)size)
+   {
+      free(data);
+      fclose(f);
+      return 0;
+   }
+   data[size] = '\0';
+   fclose(f);
+
+   *outData = data;
+   *outSize = (size_t)size;
+   return 1;
+}
+
+static char *splitField(char **cursor)
+{
+   // Returns the next tab-separated field and advances the cursor
+   char *field = *cursor;
+   char *tab = strchr(field, '\t');
+   if(tab)
+   {
+      *tab = '\0';
+      *cursor = tab + 1;
+   }
+   else
+   {
+      *cursor = field + strlen(field);
+   }
+   return field;
+}
+
+// Redaction (--redact, --redact-terms). Literal terms are compiled into a
+// single Aho-Corasick automaton over case-folded bytes; phone numbers, e-mail
+// addresses and IBANs are found by hand-written scanners in the same pass.
+enum
+{
+   RedactTerm,
+   RedactPhone,
+   RedactEmail,
+   RedactIban,
+   RedactKindCount
+};
+
+static const char *const redactLabels[RedactKindCount] = { "REDACTED", "PHONE", "EMAIL", "IBAN" };
+static const char *const redactNames[RedactKindCount] = { "terms", "phone numbers", "e-mail addresses", "IBANs" };
+
+typedef struct
+{
+   size_t start;
+   size_t end;
+   int kind;
+} RedactMatch;
+
+typedef struct
+{
+   unsigned char classOf[256];   // Byte -> alphabet class; 0 for bytes in no term
+   int classCount;
+   int *next;                    // Complete DFA, stateCount x classCount
+   int *termLen;                 // Length of the term ending in a state, 0 if none
+   int *dictLink;                // Nearest term-ending state on the fail chain, -1 if none
+   int stateCount;
+   int scanners;                 // Phone/e-mail/IBAN scanners enabled
+   int highlight;                // Wrap matches for review instead of replacing them
+   RedactMatch *matches;         // Per-line scratch space
+   size_t matchCap;
+} Redactor;
+
+static int isWordByte(unsigned char c)
+{
+   return isalnum(c) || c >= 0x80;
+}
+
+static void redactorInit(Redactor *r, int scanners, int highlight)
+{
+   memset(r, 0, sizeof(*r));
+   r->classCount = 1;
+   r->stateCount = 1;
+   r->next = (int *)calloc(1, sizeof(int));
+   r->termLen = (int *)calloc(1, sizeof(int));
+   r->dictLink = (int *)malloc(sizeof(int));
+   r->matchCap = 256;
+   r->matches = (RedactMatch *)malloc(r->matchCap * sizeof(RedactMatch));
+   if(!r->next || !r->termLen || !r->dictLink || !r->matches)
+   {
+      fatal("Out of memory creating redactor");
+   }
+   r->dictLink[0] = -1;
+   r->scanners = scanners;
+   r->highlight = highlight;
+}
+
+static void redactorFree(Redactor *r)
+{
+   free(r->next);
+   free(r->termLen);
+   free(r->dictLink);
+   free(r->matches);
+   memset(r, 0, sizeof(*r));
+}
+
+static int redactorLoadTerms(Redactor *r, const char *path)
+{
+   // One term per line, matched case-insensitively on word boundaries
+   char *data;
+   size_t size;
+   if(!readWholeFile(path, &data, &size))
+   {
+      fprintf(stderr, "Error: could not read '%s': %s\n", path, strerror(errno));
+      return 0;
+   }
+
+   // Fold case and assign alphabet classes to every byte used by a term
+   size_t total = 0;
+   for(size_t i = 0; i < size; i++)
+   {
+      unsigned char c = (unsigned char)tolower((unsigned char)data[i]);
+      data[i] = (char)c;
+      if(c == '\n' || c == '\r')
+      {
+         continue;
+      }
+      total++;
+      if(r->classOf[c] == 0)
+      {
+         r->classOf[c] = (unsigned char)r->classCount++;
+      }
+   }
+
+   int cc = r->classCount;
+   size_t maxStates = total + 1;
+   free(r->next);
+   free(r->termLen);
+   free(r->dictLink);
+   r->next = (int *)malloc(maxStates * (size_t)cc * sizeof(int));
+   r->termLen = (int *)calloc(maxStates, sizeof(int));
+   r->dictLink = (int *)malloc(maxStates * sizeof(int));
+   int *fail = (int *)calloc(maxStates, sizeof(int));
+   int *queue = (int *)malloc(maxStates * sizeof(int));
+   if(!r->next || !r->termLen || !r->dictLink || !fail || !queue)
+   {
+      fatal("Out of memory building redaction automaton");
+   }
+   for(size_t i = 0; i < maxStates * (size_t)cc; i++)
+   {
+      r->next[i] = -1;
+   }
+
+   // Trie
+   r->stateCount = 1;
+   char *line = data;
+   while(line < data + size)
+   {
+      char *eol = line;
+      while(eol < data + size && *eol != '\n')
+      {
+         eol++;
+      }
+      *eol = '\0';
+      trimRight(line);
+      const unsigned char *p = (const unsigned char *)line;
+      while(*p && isspace(*p))
+      {
+         p++;
+      }
+
+      int state = 0;
+      int len = 0;
+      for(; *p; p++, len++)
+      {
+         int *slot = &r->next[state * cc + r->classOf[*p]];
+         if(*slot < 0)
          {
-            idx = findAttachmentBySize(&list, attBytes, isImageMime(attMime));
+            *slot = r->stateCount++;
          }
+         state = *slot;
+      }
+      if(len > r->termLen[state])
+      {
+         r->termLen[state] = len;
+      }
+      line = eol + 1;
+   }
+   free(data);
 
-         if(idx >= 0)
+   // Breadth-first: fail links, dictionary links and the remaining transitions
+   size_t head = 0;
+   size_t tail = 0;
+   r->dictLink[0] = -1;
+   for(int c = 0; c < cc; c++)
+   {
+      int s = r->next[c];
+      if(s < 0)
+      {
+         r->next[c] = 0;
+      }
+      else
+      {
+         fail[s] = 0;
+         r->dictLink[s] = -1;
+         queue[tail++] = s;
+      }
+   }
+   while(head < tail)
+   {
+      int s = queue[head++];
+      for(int c = 0; c < cc; c++)
+      {
+         int t = r->next[s * cc + c];
+         int f = r->next[fail[s] * cc + c];
+         if(t < 0)
          {
-            list.items[idx].used = 1;
-
-            char relPath[MaxPathLen];
-            snprintf(relPath, sizeof(relPath), "attachments/%s", list.items[idx].fileName);
-
-            if(isImageMime(attMime) || hasImageExtension(list.items[idx].fileName))
-            {
-               writeImageInclude(out, relPath);
-            }
-            else
-            {
-               writeNonImageAttachment(out, relPath);
-            }
+            r->next[s * cc + c] = f;
          }
          else
          {
-            // Could not match: keep a note in output
-            fputs("\n\\begin{quote}\n", out);
-            fputs("\\textbf{Unmatched attachment placeholder:} ", out);
-            writeLatexEscaped(out, line);
-            fputs("\\end{quote}\n\n", out);
+            fail[t] = f;
+            r->dictLink[t] = (r->termLen[f] > 0) ? f : r->dictLink[f];
+            queue[tail++] = t;
          }
+      }
+   }
 
-         continue;
+   free(fail);
+   free(queue);
+   return 1;
+}
+
+static void redactorAddMatch(Redactor *r, size_t *count, size_t start, size_t end, int kind)
+{
+   if(*count >= r->matchCap)
+   {
+      size_t newCap = r->matchCap * 2;
+      RedactMatch *newItems = (RedactMatch *)realloc(r->matches, newCap * sizeof(RedactMatch));
+      if(!newItems)
+      {
+         fatal("Out of memory reallocating redaction matches");
       }
+      r->matches = newItems;
+      r->matchCap = newCap;
+   }
+   r->matches[*count].start = start;
+   r->matches[*count].end = end;
+   r->matches[*count].kind = kind;
+   (*count)++;
+}
 
-      // Normal text line
-      trimRight(line);
+static size_t scanPhone(const unsigned char *s, size_t len, size_t i)
+{
+   // "+49 30 1234567", "(030) 123456", "030/123456-78": 7 to 15 digits. A
+   // number without "+" or "(" must start with a trunk "0" and a group of at
+   // least three digits, which keeps dates like 01-02-2024 out.
+   size_t p = i;
+   int intl = (s[p] == '+' || s[p] == '(');
+   int digits = 0;
+   int firstGroup = 0;
+   int separators = 0;
+   size_t lastDigitEnd = 0;
 
-      if(line[0] == '\0')
+   if(s[p] == '+')
+   {
+      p++;
+   }
+   if(!intl && s[p] != '0')
+   {
+      return 0;
+   }
+   for(; p < len; p++)
+   {
+      unsigned char c = s[p];
+      if(isdigit(c))
+      {
+         digits++;
+         if(lastDigitEnd == 0 || lastDigitEnd == p)
+         {
+            firstGroup++;
+         }
+         lastDigitEnd = p + 1;
+         separators = 0;
+         if(digits > 15)
+         {
+            return 0;
+         }
+      }
+      else if((c == ' ' || c == '-' || c == '/' || c == '(' || c == ')') && separators < 2)
       {
-         fputs("\n\n", out);   // Paragraph break in LaTeX
+         if(!intl && digits > 0 && firstGroup < 3)
+         {
+            return 0;
+         }
+         separators++;
       }
       else
       {
-         writeLatexEscaped(out, line);
-         fputs("\\\\\n", out); // Keep forced line breaks only for non-empty lines
+         break;
       }
    }
+   if(digits < 7 || (lastDigitEnd < len && isWordByte(s[lastDigitEnd])))
+   {
+      return 0;
+   }
+   return lastDigitEnd;
+}
 
-   fputs("\n\\end{document}\n", out);
+static int scanEmail(const unsigned char *s, size_t len, size_t at, size_t *outStart, size_t *outEnd)
+{
+   // Local part to the left of '@', dotted domain with an alphabetic TLD to the right
+   size_t start = at;
+   while(start > 0 && (isalnum(s[start - 1]) || strchr("._%+-", s[start - 1])))
+   {
+      start--;
+   }
 
-   fclose(out);
-   fclose(in);
+   size_t end = at + 1;
+   while(end < len && (isalnum(s[end]) || s[end] == '-' || s[end] == '.'))
+   {
+      end++;
+   }
+   while(end > at + 1 && (s[end - 1] == '.' || s[end - 1] == '-'))
+   {
+      end--;
+   }
 
-   attachmentListFree(&list);
+   size_t tld = end;
+   while(tld > at + 1 && isalpha(s[tld - 1]))
+   {
+      tld--;
+   }
+   if(start == at || end - tld < 2 || tld < at + 3 || s[tld - 1] != '.')
+   {
+      return 0;
+   }
 
-   fprintf(stderr, "Wrote %s\n", outputPath);
+   *outStart = start;
+   *outEnd = end;
+   return 1;
+}
+
+static int ibanChecksumOk(const char *iban, size_t n)
+{
+   // ISO 13616: move the first four characters to the end, map letters to
+   // 10..35 and check that the number is 1 modulo 97
+   int mod = 0;
+   for(size_t k = 0; k < n; k++)
+   {
+      char c = iban[(k + 4) % n];
+      if(isdigit((unsigned char)c))
+      {
+         mod = (mod * 10 + (c - '0')) % 97;
+      }
+      else
+      {
+         mod = (mod * 100 + (c - 'A' + 10)) % 97;
+      }
+   }
+   return mod == 1;
+}
+
+static size_t scanIban(const unsigned char *s, size_t len, size_t i)
+{
+   // "DE89370400440532013000" or grouped "DE89 3704 0044 0532 0130 00"
+   char buf[40];
+   size_t n = 0;
+   size_t best = 0;
+   size_t p = i;
+   while(p < len && n < 34)
+   {
+      unsigned char c = s[p];
+      if(isdigit(c) || isupper(c))
+      {
+         buf[n++] = (char)c;
+         p++;
+         if(n >= 15 && (p >= len || !isWordByte(s[p])) && ibanChecksumOk(buf, n))
+         {
+            best = p;
+         }
+      }
+      else if(c == ' ' && n >= 4 && p + 1 < len && (isdigit(s[p + 1]) || isupper(s[p + 1])))
+      {
+         p++;
+      }
+      else
+      {
+         break;
+      }
+   }
+   return best;
+}
+
+static int compareRedactMatch(const void *a, const void *b)
+{
+   const RedactMatch *x = (const RedactMatch *)a;
+   const RedactMatch *y = (const RedactMatch *)b;
+   if(x->start != y->start)
+   {
+      return (x->start < y->start) ? -1 : 1;
+   }
+   // Longer match first
+   if(x->end != y->end)
+   {
+      return (x->end > y->end) ? -1 : 1;
+   }
    return 0;
 }
+
+static size_t redactorFind(Redactor *r, const char *line, size_t len)
+{
+   // One pass over the line; returns the number of non-overlapping matches
+   // left in r->matches, leftmost-longest first
+   const unsigned char *s = (const unsigned char *)line;
+   int cc = r->classCount;
+   int state = 0;
+   size_t count = 0;
+   size_t scanFrom = 0;
+
+   for(size_t i = 0; i < len; i++)
+   {
+      unsigned char c = s[i];
+      state = r->next[state * cc + r->classOf[tolower(c)]];
+
+      // Longest term ending here that sits on word boundaries
+      for(int t = (r->termLen[state] > 0) ? state : r->dictLink[state]; t >= 0; t = r->dictLink[t])
+      {
+         size_t start = i + 1 - (size_t)r->termLen[t];
+         int leftOk = !isWordByte(s[start]) || start == 0 || !isWordByte(s[start - 1]);
+         int rightOk = !isWordByte(c) || i + 1 == len || !isWordByte(s[i + 1]);
+         if(leftOk && rightOk)
+         {
+            redactorAddMatch(r, &count, start, i + 1, RedactTerm);
+            break;
+         }
+      }
+
+      if(!r->scanners || i < scanFrom)
+      {
+         continue;
+      }
+
+      int wordStart = (i == 0 || !isWordByte(s[i - 1]));
+      size_t end;
+      if(c == '@')
+      {
+         size_t start;
+         if(scanEmail(s, len, i, &start, &end))
+         {
+            redactorAddMatch(r, &count, start, end, RedactEmail);
+            scanFrom = end;
+         }
+      }
+      else if(wordStart && (c == '+' || c == '0' || (c == '(' && i + 1 < len && (s[i + 1] == '0' || s[i + 1] == '+'))) && (end = scanPhone(s, len, i)) > 0)
+      {
+         redactorAddMatch(r, &count, i, end, RedactPhone);
+         scanFrom = end;
+      }
+      else if(wordStart && isupper(c) && i + 3 < len && isupper(s[i + 1]) && isdigit(s[i + 2]) && isdigit(s[i + 3]) && (end = scanIban(s, len, i)) > 0)
+      {
+         redactorAddMatch(r, &count, i, end, RedactIban);
+         scanFrom = end;
+      }
+   }
+
+   if(count <= 1)
+   {
+      return count;
+   }
+
+   // Resolve overlaps: leftmost wins, then longest
+   qsort(r->matches, count, sizeof(RedactMatch), compareRedactMatch);
+   size_t kept = 0;
+   size_t coveredTo = 0;
+   for(size_t k = 0; k < count; k++)
+   {
+      if(kept > 0 && r->matches[k].start < coveredTo)
+      {
+         continue;
+      }
+      r->matches[kept++] = r->matches[k];
+      coveredTo = r->matches[k].end;
+   }
+   return kept;
+}
+
+static size_t writeRedacted(FILE *out, FILE *html, const DocumentOptions *doc, Redactor *r, const char *line, long long *counts)
+{
+   // Escapes the line, replacing or wrapping every match; html is optional.
+   // Returns the number of matches, which stay in r->matches
+   size_t len = strlen(line);
+   size_t count = redactorFind(r, line, len);
+   size_t pos = 0;
+
+   for(size_t k = 0; k < count; k++)
+   {
+      const RedactMatch *m = &r->matches[k];
+      writeLatexEscapedLen(out, doc, line + pos, m->start - pos);
+      if(html)
+      {
+         writeHtmlEscapedLen(html, line + pos, m->start - pos);
+      }
+      if(r->highlight)
+      {
+         fputs("\\reviewmark{", out);
+         writeLatexEscapedLen(out, doc, line + m->start, m->end - m->start);
+         fputs("}", out);
+         if(html)
+         {
+            fputs("<mark>", html);
+            writeHtmlEscapedLen(html, line + m->start, m->end - m->start);
+            fputs("</mark>", html);
+         }
+      }
+      else
+      {
+         fprintf(out, "\\redacted{%s}", redactLabels[m->kind]);
+         if(html)
+         {
+            fprintf(html, "<b>[%s]</b>", redactLabels[m->kind]);
+         }
+      }
+      counts[m->kind]++;
+      pos = m->end;
+   }
+   writeLatexEscapedLen(out, doc, line + pos, len - pos);
+   if(html)
+   {
+      writeHtmlEscapedLen(html, line + pos, len - pos);
+   }
+   return count;
+}
+
+static char *redactedCopy(Redactor *r, const char *text)
+{
+   // The text with every match replaced by "[LABEL]" (or kept in highlight
+   // mode), for outputs that are not LaTeX or HTML; the caller frees it
+   size_t len = strlen(text);
+   size_t count = r->highlight ? 0 : redactorFind(r, text, len);
+   char *copy = (char *)malloc(len + count * 12 + 1);   // "[REDACTED]" is the longest label
+   if(!copy)
+   {
+      fatal("Out of memory redacting text");
+   }
+   size_t pos = 0;
+   size_t used = 0;
+   for(size_t k = 0; k < count; k++)
+   {
+      const RedactMatch *m = &r->matches[k];
+      memcpy(copy + used, text + pos, m->start - pos);
+      used += m->start - pos;
+      used += (size_t)sprintf(copy + used, "[%s]", redactLabels[m->kind]);
+      pos = m->end;
+   }
+   memcpy(copy + used, text + pos, len - pos);
+   copy[used + len - pos] = '\0';
+   return copy;
+}
+
+typedef struct
+{
+   long long lines;
+   long long attachmentsMatched;
+   long long attachmentsUnmatched;
+   long long attachmentsApproximate;   // Matched within --size-tolerance
+   long long approximateMaxDiff;
+   long long quotesCollapsed;          // Quotes replaced by a reference (--dedup-quotes)
+   long long quoteBytesSkipped;        // Input bytes of those quotes, before escaping
+   long long redactions[RedactKindCount];
+} ConvertStats;
+
+static void printStats(const ConvertStats *stats, const Redactor *redactor)
+{
+   fprintf(stderr, "Converted %lld lines, %lld attachments matched, %lld unmatched\n",
+           stats->lines, stats->attachmentsMatched, stats->attachmentsUnmatched);
+   if(stats->attachmentsApproximate > 0)
+   {
+      fprintf(stderr, "Matched %lld attachments by approximate size (up to %lld bytes off)\n",
+              stats->attachmentsApproximate, stats->approximateMaxDiff);
+   }
+   if(stats->quotesCollapsed > 0)
+   {
+      fprintf(stderr, "Replaced %lld quotes of earlier messages by references (%lld quoted input bytes left out)\n",
+              stats->quotesCollapsed, stats->quoteBytesSkipped);
+   }
+   if(redactor)
+   {
+      fprintf(stderr, "%s", redactor->highlight ? "Highlighted" : "Redacted");
+      for(int k = 0; k < RedactKindCount; k++)
+      {
+         fprintf(stderr, "%s %lld %s", (k == 0) ? "" : ",", stats->redactions[k], redactNames[k]);
+      }
+      fputc('\n', stderr);
+   }
+}
+
+// Approximate size matching (--size-tolerance): files that were re-encoded or
+// re-exported may differ by a few bytes from the size the export recorded
+typedef struct
+{
+   long long bytes;   // Accepted difference in bytes...
+   double percent;    // ...or in percent of the recorded size, whichever is larger
+} SizeTolerance;
+
+static long long parseTimeText(const char *p, int *outOffset)
+{
+   // "Wed, 01 Jan 2024 10:00:00 +0100" (or "2024-01-01 10:00:00") to seconds
+   // since the epoch; -1 if the text cannot be parsed. outOffset, if given,
+   // receives the UTC offset in seconds
+   const char *comma = strchr(p, ',');
+   if(comma)
+   {
+      p = comma + 1;
+   }
+
+   int day, month, year, hour, min, sec;
+   char monthName[4];
+   char sign = '+';
+   int offset = 0;
+   int n = sscanf(p, " %d %3s %d %d:%d:%d %c%4d", &day, monthName, &year, &hour, &min, &sec, &sign, &offset);
+   static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+   const char *m = (n >= 6) ? strstr(months, monthName) : NULL;
+   if(m && strlen(monthName) == 3 && (m - months) % 3 == 0)
+   {
+      month = (int)(m - months) / 3 + 1;
+   }
+   else if(sscanf(p, " %d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &min, &sec) == 6)
+   {
+      // "2024-01-07 10:00:00" also fills the first pattern, with month "-01"
+      n = 6;
+   }
+   else
+   {
+      return -1;
+   }
+
+   // Days since 1970-01-01 in the proleptic Gregorian calendar
+   int y = year - (month <= 2);
+   int era = (y >= 0 ? y : y - 399) / 400;
+   int yoe = y - era * 400;
+   int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+   int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+   long long days = (long long)era * 146097 + doe - 719468;
+
+   long long t = days * 86400 + hour * 3600 + min * 60 + sec;
+   int offsetSec = 0;
+   if(n == 8 && (sign == '+' || sign == '-'))
+   {
+      offsetSec = (offset / 100) * 3600 + (offset % 100) * 60;
+      if(sign == '-')
+      {
+         offsetSec = -offsetSec;
+      }
+   }
+   if(outOffset)
+   {
+      *outOffset = offsetSec;
+   }
+   return t - offsetSec;
+}
+
+static long long parseSentTime(const char *line, int *outOffset)
+{
+   // "Sent: <time>" as in parseTimeText
+   return parseTimeText(line + strlen("Sent:"), outOffset);
+}
+
+static long long parseSinceDate(const char *text)
+{
+   // "YYYY-MM-DD", "YYYY-MM-DD HH:MM:SS" or a Sent: time, in UTC unless the
+   // time has an offset; -1 if it cannot be parsed
+   long long t = parseTimeText(text, NULL);
+   int year, month, day;
+   char rest;
+   if(t < 0 && sscanf(text, "%d-%d-%d%c", &year, &month, &day, &rest) == 3)
+   {
+      char full[64];
+      snprintf(full, sizeof(full), "%d-%d-%d 00:00:00", year, month, day);
+      t = parseTimeText(full, NULL);
+   }
+   return t;
+}
+
+// Tail mode (--tail N, --since DATE): the export is read backwards in blocks
+// of TailBlockSize with pread, classifying lines from the end until enough
+// message starts (or one sent before the cutoff) are found
+#define TailBlockSize (4 << 20)
+
+static long long findTailStart(const char *inputPath, long long tailCount, long long since, long long *outMessages)
+{
+   // Returns the offset of the first message to convert: the tailCount-th
+   // message from the end (tailCount 0: no limit) or the first message sent
+   // at or after since (since -1: no limit), whichever starts later. Returns
+   // -1 on error
+   int fd = open(inputPath, O_RDONLY);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) != 0)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", inputPath, strerror(errno));
+      if(fd >= 0)
+      {
+         close(fd);
+      }
+      return -1;
+   }
+
+   long long scanStart = traceBegin();
+   size_t cap = TailBlockSize;
+   char *buf = (char *)malloc(cap);
+   if(!buf)
+   {
+      fatal("Out of memory reading blocks");
+   }
+   long long dataStart = (long long)st.st_size;   // buf holds [dataStart, dataStart + len)
+   size_t len = 0;                                // Unprocessed start of a line
+   long long start = dataStart;                   // Nothing accepted yet
+   long long messages = 0;
+   long long nextOffset = -1;                     // Line after the current one
+   int nextIsStart = 0;
+   long long sent = -1;                           // Sent time of the message being read
+   int done = 0;
+   int ok = 1;
+
+   while(!done)
+   {
+      // Prepend the block before the unprocessed bytes
+      size_t want = (dataStart < TailBlockSize) ? (size_t)dataStart : TailBlockSize;
+      if(want + len > cap)
+      {
+         cap = want + len;
+         char *grown = (char *)realloc(buf, cap);
+         if(!grown)
+         {
+            fatal("Out of memory reading blocks");
+         }
+         buf = grown;
+      }
+      memmove(buf + want, buf, len);
+      for(size_t got = 0; got < want;)
+      {
+         ssize_t n = pread(fd, buf + got, want - got, (off_t)(dataStart - (long long)want + (long long)got));
+         if(n <= 0)
+         {
+            if(n < 0 && errno == EINTR)
+            {
+               continue;
+            }
+            fprintf(stderr, "Error: could not read '%s': %s\n", inputPath, (n < 0) ? strerror(errno) : "file shrank");
+            ok = 0;
+            break;
+         }
+         got += (size_t)n;
+      }
+      if(!ok)
+      {
+         break;
+      }
+      dataStart -= (long long)want;
+      len += want;
+
+      // Complete lines from the end; the first one is complete only at the start of the file
+      size_t end = len;
+      while(!done && end > 0)
+      {
+         size_t textEnd = (buf[end - 1] == '\n') ? end - 1 : end;
+         size_t lineStart = textEnd;
+         while(lineStart > 0 && buf[lineStart - 1] != '\n')
+         {
+            lineStart--;
+         }
+         if(lineStart == 0 && dataStart > 0)
+         {
+            break;
+         }
+
+         char line[256];
+         size_t n = textEnd - lineStart;
+         if(n > sizeof(line) - 1)
+         {
+            n = sizeof(line) - 1;
+         }
+         memcpy(line, buf + lineStart, n);
+         line[n] = '\0';
+         trimRight(line);
+         int kind = classifyLine(line);
+         int flags = lineRules[kind].flags;
+
+         if(nextIsStart && !(flags & LineHeader))
+         {
+            // The line after this one starts a message
+            if(since >= 0 && sent >= 0 && sent < since)
+            {
+               done = 1;
+               break;
+            }
+            start = nextOffset;
+            messages++;
+            sent = -1;
+            done = (tailCount > 0 && messages == tailCount);
+            if(done)
+            {
+               break;
+            }
+         }
+         if(kind == LineSent)
+         {
+            sent = parseSentTime(line, NULL);
+         }
+         nextOffset = dataStart + (long long)lineStart;
+         nextIsStart = (flags & LineStart) != 0;
+         end = lineStart;
+      }
+      len = end;
+
+      if(!done && dataStart == 0 && len == 0)
+      {
+         // Start of file: the first line starts a message, and text before it is kept
+         if(nextIsStart)
+         {
+            if(!(since >= 0 && sent >= 0 && sent < since))
+            {
+               messages++;
+               start = 0;
+            }
+         }
+         else if(since < 0 || messages > 0)
+         {
+            start = 0;
+         }
+         done = 1;
+      }
+   }
+   free(buf);
+   close(fd);
+   traceEnd("scan", "tail", scanStart, messages);
+
+   *outMessages = messages;
+   return ok ? start : -1;
+}
+
+static long long parseQuoteHeader(const char *line, const char **outSender, size_t *outSenderLen, const char **outTime)
+{
+   // "Quote: <sender>, <time>" with the quoted message's sender and sent
+   // time; the sender ends at the first comma followed by a parseable time
+   // (names may contain commas) and a "(+phone)" suffix is dropped. Returns
+   // the time or -1; *outTime points to its text
+   const char *sender = line + strlen("Quote:");
+   while(*sender == ' ')
+   {
+      sender++;
+   }
+   for(const char *comma = strchr(sender, ','); comma; comma = strchr(comma + 1, ','))
+   {
+      long long t = parseTimeText(comma + 1, NULL);
+      if(t < 0)
+      {
+         continue;
+      }
+      const char *end = comma;
+      const char *paren = memchr(sender, '(', (size_t)(comma - sender));
+      if(paren)
+      {
+         end = paren;
+      }
+      while(end > sender && end[-1] == ' ')
+      {
+         end--;
+      }
+      *outSender = sender;
+      *outSenderLen = (size_t)(end - sender);
+      *outTime = comma + 1 + strspn(comma + 1, " ");
+      return t;
+   }
+   return -1;
+}
+
+static int matchAttachment(AttachmentList *list, const char *line, const SizeTolerance *tolerance, long long sentTime,
+                           char *outMime, size_t outMimeCap, long long *outSizeDiff)
+{
+   // Returns the unused file an "Attachment:" line refers to, or -1. Exact
+   // matches win; *outSizeDiff is the byte difference of an approximate match
+   char attName[MaxPathLen];
+   long long attBytes = -1;
+   int hasName = 0;
+
+   parseAttachmentLine(line, attName, sizeof(attName), outMime, outMimeCap, &attBytes, &hasName);
+   *outSizeDiff = 0;
+
+   int idx = -1;
+   if(hasName)
+   {
+      idx = findAttachmentByExactName(list, attName);
+   }
+   if(idx < 0 && attBytes >= 0)
+   {
+      idx = findAttachmentBySize(list, attBytes, isImageMime(outMime));
+   }
+   if(idx < 0 && attBytes >= 0 && tolerance)
+   {
+      long long slack = tolerance->bytes;
+      long long relative = (long long)((double)attBytes * tolerance->percent / 100.0);
+      if(relative > slack)
+      {
+         slack = relative;
+      }
+      if(slack > 0)
+      {
+         idx = findAttachmentNearSize(list, attBytes, slack, outMime, sentTime);
+      }
+      if(idx >= 0)
+      {
+         *outSizeDiff = llabs(list->items[idx].fileSize - attBytes);
+      }
+   }
+   return idx;
+}
+
+// Conversation analytics (--analytics FILE), gathered in the conversion pass:
+// messages per sender (names interned to ids), per day (one counter per day
+// from the first to the last), attachment count and volume per MIME type, and
+// emoji frequency (counters for the emoji blocks). Written as compact JSON, or
+// CSV if FILE ends in ".csv".
+#define EmojiBlockSize (0x1FB00 - 0x1F000)
+#define EmojiSymbolsSize (0x2800 - 0x2600)
+#define AnalyticsSampleEvery 61   // Lines per timed line; prime, so it does not follow the message layout
+
+typedef struct
+{
+   StrMap senderIds;         // Sender name -> id
+   char **senderNames;       // By id, owned by senderIds
+   long long *senderCounts;
+   size_t senderCount;
+   size_t senderCap;
+   long long firstDay;       // Day number (since 1970-01-01, local time) of days[0]
+   long long *days;
+   size_t dayCount;
+   StrMap mimeIds;           // MIME type -> index into mimeCounts/mimeBytes
+   long long *mimeCounts;
+   long long *mimeBytes;
+   size_t mimeCap;
+   long long *emoji;         // By slot, see emojiSlot
+   long long messages;
+   Redactor *redactor;       // Optional: sender names are written redacted
+   long long lines;          // Lines collected...
+   long long sampled;        // ...and how many of them were timed
+   struct timespec spent;    // Time spent collecting the sampled lines
+} Analytics;
+
+static void analyticsInit(Analytics *a)
+{
+   memset(a, 0, sizeof(*a));
+   strMapInit(&a->senderIds);
+   strMapInit(&a->mimeIds);
+   a->emoji = (long long *)calloc(EmojiBlockSize + EmojiSymbolsSize, sizeof(long long));
+   if(!a->emoji)
+   {
+      fatal("Out of memory allocating emoji counters");
+   }
+}
+
+static void analyticsFree(Analytics *a)
+{
+   strMapFree(&a->senderIds);
+   strMapFree(&a->mimeIds);
+   free(a->senderNames);
+   free(a->senderCounts);
+   free(a->days);
+   free(a->mimeCounts);
+   free(a->mimeBytes);
+   free(a->emoji);
+}
+
+static void analyticsTimeStart(struct timespec *start)
+{
+   clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static void analyticsTimeStop(Analytics *a, const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   a->spent.tv_sec += now.tv_sec - start->tv_sec;
+   a->spent.tv_nsec += now.tv_nsec - start->tv_nsec;
+   if(a->spent.tv_nsec >= 1000000000L)
+   {
+      a->spent.tv_sec++;
+      a->spent.tv_nsec -= 1000000000L;
+   }
+   else if(a->spent.tv_nsec < 0)
+   {
+      a->spent.tv_sec--;
+      a->spent.tv_nsec += 1000000000L;
+   }
+}
+
+static size_t analyticsGrowSlot(void *arrayPtr, size_t *cap, size_t need, size_t itemSize)
+{
+   // Grows the zero-filled array at *arrayPtr to hold index need
+   char **array = (char **)arrayPtr;
+   if(need < *cap)
+   {
+      return need;
+   }
+   size_t newCap = *cap ? *cap : 64;
+   while(newCap <= need)
+   {
+      newCap *= 2;
+   }
+   char *grown = (char *)realloc(*array, newCap * itemSize);
+   if(!grown)
+   {
+      fatal("Out of memory growing analytics");
+   }
+   memset(grown + *cap * itemSize, 0, (newCap - *cap) * itemSize);
+   *array = grown;
+   *cap = newCap;
+   return need;
+}
+
+static void analyticsSender(Analytics *a, const char *fromLine)
+{
+   // Counts a message; fromLine has had its phone number stripped
+   const char *name = fromLine + strlen("From:");
+   while(*name && isspace((unsigned char)*name))
+   {
+      name++;
+   }
+
+   long long *id = strMapInsert(&a->senderIds, name, (long long)a->senderCount);
+   if((size_t)*id == a->senderCount)
+   {
+      size_t cap = a->senderCap;
+      analyticsGrowSlot(&a->senderCounts, &a->senderCap, a->senderCount, sizeof(long long));
+      analyticsGrowSlot(&a->senderNames, &cap, a->senderCount, sizeof(char *));
+      a->senderNames[a->senderCount++] = NULL;   // Filled in when writing
+   }
+   a->senderCounts[*id]++;
+   a->messages++;
+}
+
+static void analyticsDay(Analytics *a, const char *sentLine)
+{
+   int offset = 0;
+   long long t = parseSentTime(sentLine, &offset);
+   if(t < 0)
+   {
+      return;
+   }
+   long long local = t + offset;
+   long long day = (local >= 0) ? local / 86400 : -((-local + 86399) / 86400);
+
+   if(a->dayCount == 0)
+   {
+      a->firstDay = day;
+   }
+   else if(day < a->firstDay)
+   {
+      // Exports are in time order, so this is rare: shift the buckets up
+      size_t shift = (size_t)(a->firstDay - day);
+      long long *grown = (long long *)calloc(a->dayCount + shift, sizeof(long long));
+      if(!grown)
+      {
+         fatal("Out of memory growing analytics");
+      }
+      memcpy(grown + shift, a->days, a->dayCount * sizeof(long long));
+      free(a->days);
+      a->days = grown;
+      a->dayCount += shift;
+      a->firstDay = day;
+   }
+
+   size_t slot = (size_t)(day - a->firstDay);
+   if(slot >= a->dayCount)
+   {
+      long long *grown = (long long *)realloc(a->days, (slot + 1) * sizeof(long long));
+      if(!grown)
+      {
+         fatal("Out of memory growing analytics");
+      }
+      memset(grown + a->dayCount, 0, (slot + 1 - a->dayCount) * sizeof(long long));
+      a->days = grown;
+      a->dayCount = slot + 1;
+   }
+   a->days[slot]++;
+}
+
+static void analyticsAttachment(Analytics *a, const char *line)
+{
+   char attName[MaxPathLen];
+   char attMime[128];
+   long long attBytes = -1;
+   int hasName = 0;
+   parseAttachmentLine(line, attName, sizeof(attName), attMime, sizeof(attMime), &attBytes, &hasName);
+
+   long long *idx = strMapInsert(&a->mimeIds, attMime[0] ? attMime : "unknown", (long long)a->mimeIds.count);
+   size_t cap = a->mimeCap;
+   analyticsGrowSlot(&a->mimeCounts, &a->mimeCap, (size_t)*idx, sizeof(long long));
+   analyticsGrowSlot(&a->mimeBytes, &cap, (size_t)*idx, sizeof(long long));
+   a->mimeCounts[*idx]++;
+   if(attBytes > 0)
+   {
+      a->mimeBytes[*idx] += attBytes;
+   }
+}
+
+static int emojiSlot(unsigned long cp)
+{
+   if(cp >= 0x1F000 && cp < 0x1FB00)
+   {
+      return (int)(cp - 0x1F000);
+   }
+   if(cp >= 0x2600 && cp < 0x2800)
+   {
+      return EmojiBlockSize + (int)(cp - 0x2600);
+   }
+   return -1;
+}
+
+static unsigned long emojiSlotCodepoint(int slot)
+{
+   return (slot < EmojiBlockSize) ? 0x1F000 + (unsigned long)slot : 0x2600 + (unsigned long)(slot - EmojiBlockSize);
+}
+
+static void analyticsText(Analytics *a, const char *line)
+{
+   // Counts emoji in the two blocks; skin tone modifiers are not counted
+   // separately, regional indicators (flag halves) are
+   const unsigned char *p = (const unsigned char *)line;
+   while(*p)
+   {
+      if(*p < 0xE2)
+      {
+         p++;
+         continue;
+      }
+      int len = utf8CharLen(*p);
+      int avail = (int)strnlen((const char *)p, (size_t)len);
+      if(len < 3 || avail < len)
+      {
+         p += (avail > 0) ? avail : 1;
+         continue;
+      }
+      int slot = emojiSlot(utf8Decode(p, len));
+      if(slot >= 0 && !(slot >= 0x1F3FB - 0x1F000 && slot <= 0x1F3FF - 0x1F000))
+      {
+         a->emoji[slot]++;
+      }
+      p += len;
+   }
+}
+
+static void analyticsLine(Analytics *a, int kind, const char *line)
+{
+   // Reading the clock costs about as much as collecting a line, so only
+   // every AnalyticsSampleEvery-th line is timed
+   struct timespec start;
+   int timed = (a->lines++ % AnalyticsSampleEvery == 0);
+   if(timed)
+   {
+      analyticsTimeStart(&start);
+      a->sampled++;
+   }
+   if(kind == LineFrom)
+   {
+      analyticsSender(a, line);
+   }
+   else if(kind == LineSent)
+   {
+      analyticsDay(a, line);
+   }
+   else if(kind == LineAttachment)
+   {
+      analyticsAttachment(a, line);
+   }
+   else if(kind == LineText || kind == LineReaction)
+   {
+      analyticsText(a, line);
+   }
+   if(timed)
+   {
+      analyticsTimeStop(a, &start);
+   }
+}
+
+static void writeCsvField(FILE *out, const char *s)
+{
+   if(!strpbrk(s, ",\"\n"))
+   {
+      fputs(s, out);
+      return;
+   }
+   fputc('"', out);
+   for(; *s; s++)
+   {
+      if(*s == '"')
+      {
+         fputc('"', out);
+      }
+      fputc(*s, out);
+   }
+   fputc('"', out);
+}
+
+static void writeJsonString(FILE *out, const char *s)
+{
+   fputc('"', out);
+   for(; *s; s++)
+   {
+      unsigned char c = (unsigned char)*s;
+      if(c == '"' || c == '\\')
+      {
+         fputc('\\', out);
+         fputc(c, out);
+      }
+      else if(c < 0x20)
+      {
+         fprintf(out, "\\u%04x", c);
+      }
+      else
+      {
+         fputc(c, out);
+      }
+   }
+   fputc('"', out);
+}
+
+static void formatDay(long long day, char *out, size_t cap)
+{
+   // Day number since 1970-01-01 to YYYY-MM-DD (inverse of parseSentTime's calendar)
+   long long z = day + 719468;
+   long long era = (z >= 0 ? z : z - 146096) / 146097;
+   long long doe = z - era * 146097;
+   long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+   long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+   long long mp = (5 * doy + 2) / 153;
+   long long d = doy - (153 * mp + 2) / 5 + 1;
+   long long m = mp + (mp < 10 ? 3 : -9);
+   long long y = yoe + era * 400 + (m <= 2);
+   snprintf(out, cap, "%04lld-%02lld-%02lld", y, m, d);
+}
+
+static int analyticsWrite(Analytics *a, const char *path)
+{
+   FILE *out = fopen(path, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", path, strerror(errno));
+      return 0;
+   }
+   const char *ext = strrchr(path, '.');
+   int csv = ext && strcmp(ext, ".csv") == 0;
+
+   for(size_t i = 0; i < a->senderIds.capacity; i++)
+   {
+      if(a->senderIds.keys[i])
+      {
+         // Names are interned as read; redacting only here keeps it off the per-message path
+         a->senderNames[a->senderIds.values[i]] = a->redactor ? redactedCopy(a->redactor, a->senderIds.keys[i])
+                                                              : a->senderIds.keys[i];
+      }
+   }
+   char **mimeNames = (char **)calloc(a->mimeIds.count + 1, sizeof(char *));
+   if(!mimeNames)
+   {
+      fatal("Out of memory writing analytics");
+   }
+   for(size_t i = 0; i < a->mimeIds.capacity; i++)
+   {
+      if(a->mimeIds.keys[i])
+      {
+         mimeNames[a->mimeIds.values[i]] = a->mimeIds.keys[i];
+      }
+   }
+
+   // Emoji by descending count
+   int *order = (int *)malloc((EmojiBlockSize + EmojiSymbolsSize) * sizeof(int));
+   if(!order)
+   {
+      fatal("Out of memory writing analytics");
+   }
+   int emojiCount = 0;
+   for(int i = 0; i < EmojiBlockSize + EmojiSymbolsSize; i++)
+   {
+      if(a->emoji[i] > 0)
+      {
+         int j = emojiCount++;
+         while(j > 0 && a->emoji[order[j - 1]] < a->emoji[i])
+         {
+            order[j] = order[j - 1];
+            j--;
+         }
+         order[j] = i;
+      }
+   }
+
+   char date[64];   // Room for any long long year, which formatDay does not clamp
+   if(csv)
+   {
+      fputs("section,key,count,bytes\n", out);
+      for(size_t i = 0; i < a->senderCount; i++)
+      {
+         fputs("sender,", out);
+         writeCsvField(out, a->senderNames[i]);
+         fprintf(out, ",%lld,\n", a->senderCounts[i]);
+      }
+      for(size_t i = 0; i < a->dayCount; i++)
+      {
+         if(a->days[i] > 0)
+         {
+            formatDay(a->firstDay + (long long)i, date, sizeof(date));
+            fprintf(out, "day,%s,%lld,\n", date, a->days[i]);
+         }
+      }
+      for(size_t i = 0; i < a->mimeIds.count; i++)
+      {
+         fputs("attachment,", out);
+         writeCsvField(out, mimeNames[i]);
+         fprintf(out, ",%lld,%lld\n", a->mimeCounts[i], a->mimeBytes[i]);
+      }
+      for(int k = 0; k < emojiCount; k++)
+      {
+         fprintf(out, "emoji,U+%04lX,%lld,\n", emojiSlotCodepoint(order[k]), a->emoji[order[k]]);
+      }
+   }
+   else
+   {
+      fprintf(out, "{\"messages\":%lld,\"senders\":[", a->messages);
+      for(size_t i = 0; i < a->senderCount; i++)
+      {
+         fputs((i > 0) ? ",{\"name\":" : "{\"name\":", out);
+         writeJsonString(out, a->senderNames[i]);
+         fprintf(out, ",\"messages\":%lld}", a->senderCounts[i]);
+      }
+      fputs("],\"days\":[", out);
+      int first = 1;
+      for(size_t i = 0; i < a->dayCount; i++)
+      {
+         if(a->days[i] > 0)
+         {
+            formatDay(a->firstDay + (long long)i, date, sizeof(date));
+            fprintf(out, "%s{\"date\":\"%s\",\"messages\":%lld}", first ? "" : ",", date, a->days[i]);
+            first = 0;
+         }
+      }
+      fputs("],\"attachments\":[", out);
+      for(size_t i = 0; i < a->mimeIds.count; i++)
+      {
+         fputs((i > 0) ? ",{\"type\":" : "{\"type\":", out);
+         writeJsonString(out, mimeNames[i]);
+         fprintf(out, ",\"count\":%lld,\"bytes\":%lld}", a->mimeCounts[i], a->mimeBytes[i]);
+      }
+      fputs("],\"emoji\":[", out);
+      for(int k = 0; k < emojiCount; k++)
+      {
+         fprintf(out, "%s{\"codepoint\":\"U+%04lX\",\"count\":%lld}", (k > 0) ? "," : "",
+                 emojiSlotCodepoint(order[k]), a->emoji[order[k]]);
+      }
+      fputs("]}\n", out);
+   }
+   free(mimeNames);
+   free(order);
+   for(size_t i = 0; a->redactor && i < a->senderCount; i++)
+   {
+      free(a->senderNames[i]);
+   }
+
+   int ok = !ferror(out);
+   ok = (fclose(out) == 0) && ok;
+   if(ok)
+   {
+      fprintf(stderr, "Wrote %s (%zu senders, %zu days, %d distinct emoji)\n", path, a->senderCount, a->dayCount, emojiCount);
+   }
+   return ok;
+}
+
+// Full-text search index (--index, --query). Every text line written to the
+// .tex output is split into terms (runs of letters, digits and non-ASCII
+// bytes, ASCII case-folded); a term's postings are (message number, input
+// line number, term position in the line), stored as LEB128 deltas.
+// "<name>.idx" is laid out for mmap: a header, the .tex byte offset of every
+// message, a table of terms sorted by bytes, the term strings and the
+// postings, all in host byte order. Offsets are taken per message, as
+// ftello costs a system call.
+#define IndexMaxTerm 64
+#define IndexMagic "txidx01"
+
+typedef struct
+{
+   char magic[8];
+   uint64_t termCount;
+   uint64_t messageCount;     // Messages are numbered from 1; 0 is text before the first
+   uint64_t messagesOffset;   // uint64_t[messageCount + 1], .tex offset of each message
+   uint64_t termsOffset;      // IndexTerm[termCount]
+   uint64_t stringsOffset;
+   uint64_t postingsOffset;
+   uint64_t size;             // Total file size
+} IndexHeader;
+
+typedef struct
+{
+   uint64_t stringOffset;     // Relative to stringsOffset
+   uint64_t postingsOffset;   // Relative to postingsOffset
+   uint64_t postingsLength;
+   uint32_t stringLength;
+   uint32_t postingCount;
+} IndexTerm;
+
+typedef struct
+{
+   unsigned char *data;
+   size_t len;
+   size_t cap;
+   long long lastMessage;
+   long long lastLine;
+   uint32_t count;
+} IndexPostings;
+
+typedef struct
+{
+   StrMap termIds;            // Term -> index into terms
+   IndexPostings *terms;
+   size_t termCap;
+   long long messages;        // Number of the current message, 0 before the first
+   uint64_t *messageOffsets;  // .tex offset by message number
+   size_t messageCap;
+   long long tokens;
+   char *scratch;             // Redacted copy of the current line
+   size_t scratchCap;
+} SearchIndex;
+
+static void searchIndexMessage(SearchIndex *ix, long long outOffset, int next)
+{
+   // Records where the next message (or message 0) starts in the .tex output
+   if(next)
+   {
+      ix->messages++;
+   }
+   if((size_t)ix->messages >= ix->messageCap)
+   {
+      size_t newCap = ix->messageCap ? ix->messageCap * 2 : 1024;
+      uint64_t *grown = (uint64_t *)realloc(ix->messageOffsets, newCap * sizeof(uint64_t));
+      if(!grown)
+      {
+         fatal("Out of memory growing search index");
+      }
+      ix->messageOffsets = grown;
+      ix->messageCap = newCap;
+   }
+   ix->messageOffsets[ix->messages] = (uint64_t)outOffset;
+}
+
+static void searchIndexInit(SearchIndex *ix, long long bodyStart)
+{
+   memset(ix, 0, sizeof(*ix));
+   strMapInit(&ix->termIds);
+   searchIndexMessage(ix, bodyStart, 0);
+}
+
+static void searchIndexFree(SearchIndex *ix)
+{
+   for(size_t i = 0; i < ix->termIds.count; i++)
+   {
+      free(ix->terms[i].data);
+   }
+   free(ix->terms);
+   free(ix->messageOffsets);
+   free(ix->scratch);
+   strMapFree(&ix->termIds);
+}
+
+static size_t nextIndexTerm(const char *s, size_t len, size_t *pos, char *term)
+{
+   // Returns the length of the next term from *pos (0 at the end of s) and
+   // copies it, case-folded and cut at IndexMaxTerm bytes, NUL-terminated
+   size_t i = *pos;
+   while(i < len && !isWordByte((unsigned char)s[i]))
+   {
+      i++;
+   }
+   size_t n = 0;
+   while(i < len && isWordByte((unsigned char)s[i]))
+   {
+      if(n < IndexMaxTerm)
+      {
+         term[n++] = (char)tolower((unsigned char)s[i]);
+      }
+      i++;
+   }
+   term[n] = '\0';
+   *pos = i;
+   return n;
+}
+
+static void putVarint(IndexPostings *p, uint64_t v)
+{
+   if(p->len + 10 > p->cap)
+   {
+      size_t newCap = p->cap ? p->cap * 2 : 16;
+      unsigned char *grown = (unsigned char *)realloc(p->data, newCap);
+      if(!grown)
+      {
+         fatal("Out of memory growing search index");
+      }
+      p->data = grown;
+      p->cap = newCap;
+   }
+   while(v >= 0x80)
+   {
+      p->data[p->len++] = (unsigned char)(v | 0x80);
+      v >>= 7;
+   }
+   p->data[p->len++] = (unsigned char)v;
+}
+
+static const unsigned char *getVarint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+   // Returns the byte after the varint, or NULL if it runs past end
+   uint64_t value = 0;
+   for(int shift = 0; p < end && shift < 64; shift += 7)
+   {
+      unsigned char b = *p++;
+      value |= (uint64_t)(b & 0x7F) << shift;
+      if(!(b & 0x80))
+      {
+         *v = value;
+         return p;
+      }
+   }
+   return NULL;
+}
+
+static void searchIndexLine(SearchIndex *ix, const char *line, size_t len, const Redactor *r, size_t matchCount,
+                            long long inputLine)
+{
+   // Adds the terms of a written line; with r, the matches left in
+   // r->matches are indexed as their labels unless highlighting
+   if(r && matchCount > 0 && !r->highlight)
+   {
+      size_t need = len + matchCount * 16 + 1;
+      if(need > ix->scratchCap)
+      {
+         free(ix->scratch);
+         ix->scratch = (char *)malloc(need);
+         if(!ix->scratch)
+         {
+            fatal("Out of memory indexing line");
+         }
+         ix->scratchCap = need;
+      }
+      size_t used = 0;
+      size_t from = 0;
+      for(size_t k = 0; k < matchCount; k++)
+      {
+         const RedactMatch *m = &r->matches[k];
+         memcpy(ix->scratch + used, line + from, m->start - from);
+         used += m->start - from;
+         used += (size_t)sprintf(ix->scratch + used, " %s ", redactLabels[m->kind]);
+         from = m->end;
+      }
+      memcpy(ix->scratch + used, line + from, len - from);
+      used += len - from;
+      line = ix->scratch;
+      len = used;
+   }
+
+   char term[IndexMaxTerm + 1];
+   size_t pos = 0;
+   uint32_t ordinal = 0;
+   size_t n;
+   while((n = nextIndexTerm(line, len, &pos, term)) > 0)
+   {
+      long long *id = strMapInsert(&ix->termIds, term, (long long)ix->termIds.count);
+      if((size_t)*id >= ix->termCap)
+      {
+         size_t newCap = ix->termCap ? ix->termCap * 2 : 1024;
+         IndexPostings *grown = (IndexPostings *)realloc(ix->terms, newCap * sizeof(IndexPostings));
+         if(!grown)
+         {
+            fatal("Out of memory growing search index");
+         }
+         memset(grown + ix->termCap, 0, (newCap - ix->termCap) * sizeof(IndexPostings));
+         ix->terms = grown;
+         ix->termCap = newCap;
+      }
+      IndexPostings *p = &ix->terms[*id];
+      putVarint(p, (uint64_t)(ix->messages - p->lastMessage));
+      putVarint(p, (uint64_t)(inputLine - p->lastLine));
+      putVarint(p, ordinal++);
+      p->lastMessage = ix->messages;
+      p->lastLine = inputLine;
+      p->count++;
+      ix->tokens++;
+   }
+}
+
+static const StrMap *indexSortMap;
+
+static int compareIndexTerms(const void *a, const void *b)
+{
+   return strcmp(indexSortMap->keys[*(const size_t *)a], indexSortMap->keys[*(const size_t *)b]);
+}
+
+static int searchIndexWrite(SearchIndex *ix, const char *path)
+{
+   // Written to "<path>.tmp" and renamed, so a failed run keeps the old index
+   char tmpPath[MaxPathLen];
+   snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+   FILE *out = fopen(tmpPath, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", tmpPath, strerror(errno));
+      return 0;
+   }
+
+   // Map slots in key order
+   size_t count = ix->termIds.count;
+   size_t *slots = (size_t *)malloc((count + 1) * sizeof(size_t));
+   IndexTerm *table = (IndexTerm *)calloc(count + 1, sizeof(IndexTerm));
+   if(!slots || !table)
+   {
+      fatal("Out of memory writing search index");
+   }
+   size_t n = 0;
+   for(size_t i = 0; i < ix->termIds.capacity; i++)
+   {
+      if(ix->termIds.keys[i])
+      {
+         slots[n++] = i;
+      }
+   }
+   indexSortMap = &ix->termIds;
+   qsort(slots, n, sizeof(size_t), compareIndexTerms);
+
+   uint64_t stringsLen = 0;
+   uint64_t postingsLen = 0;
+   for(size_t k = 0; k < n; k++)
+   {
+      const char *key = ix->termIds.keys[slots[k]];
+      const IndexPostings *p = &ix->terms[ix->termIds.values[slots[k]]];
+      table[k].stringOffset = stringsLen;
+      table[k].stringLength = (uint32_t)strlen(key);
+      table[k].postingsOffset = postingsLen;
+      table[k].postingsLength = p->len;
+      table[k].postingCount = p->count;
+      stringsLen += table[k].stringLength;
+      postingsLen += p->len;
+   }
+
+   IndexHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, IndexMagic, sizeof(h.magic));
+   h.termCount = n;
+   h.messageCount = (uint64_t)ix->messages;
+   h.messagesOffset = sizeof(h);
+   h.termsOffset = h.messagesOffset + (h.messageCount + 1) * sizeof(uint64_t);
+   h.stringsOffset = h.termsOffset + n * sizeof(IndexTerm);
+   h.postingsOffset = h.stringsOffset + stringsLen;
+   h.size = h.postingsOffset + postingsLen;
+
+   fwrite(&h, sizeof(h), 1, out);
+   fwrite(ix->messageOffsets, sizeof(uint64_t), (size_t)ix->messages + 1, out);
+   fwrite(table, sizeof(IndexTerm), n, out);
+   for(size_t k = 0; k < n; k++)
+   {
+      fwrite(ix->termIds.keys[slots[k]], 1, table[k].stringLength, out);
+   }
+   for(size_t k = 0; k < n; k++)
+   {
+      const IndexPostings *p = &ix->terms[ix->termIds.values[slots[k]]];
+      fwrite(p->data, 1, p->len, out);
+   }
+   free(slots);
+   free(table);
+
+   int ok = !ferror(out);
+   ok = (fclose(out) == 0) && ok;
+   if(ok && rename(tmpPath, path) != 0)
+   {
+      fprintf(stderr, "Error: could not rename '%s' to '%s': %s\n", tmpPath, path, strerror(errno));
+      ok = 0;
+   }
+   if(!ok)
+   {
+      remove(tmpPath);
+      return 0;
+   }
+   fprintf(stderr, "Wrote %s (%zu terms, %lld occurrences, %lld messages)\n", path, n, ix->tokens, ix->messages);
+   return 1;
+}
+
+// Attachment resolution cache (--attachment-cache). "<name>.attcache" maps every
+// reference, identified by a hash of the From/Sent lines of its message, its
+// ordinal within the message and the reference line itself, to the file it
+// resolved to with that file's size and modification time. Only the hash is
+// stored, so sender names and numbers stay out of the cache file. References
+// whose file is present and unchanged skip the name and size searches; keys
+// that occur more than once (identical messages) are always searched again.
+// The file is rewritten after each run.
+typedef struct
+{
+   const char *fileName;   // Points into the loaded file
+   long long fileSize;
+   long long mtime;
+} CachedAttachment;
+
+typedef struct
+{
+   char path[MaxPathLen];
+   char tmpPath[MaxPathLen + 8];
+   char *data;                  // Loaded cache file, split in place
+   CachedAttachment *entries;
+   size_t entryCount;
+   StrMap refs;                 // Reference key (hex) -> entry index, -1 if not unique
+   FILE *out;                   // Replacement file, written as references resolve
+   long long hits;
+} AttachmentCache;
+
+static int attachmentCacheOpen(AttachmentCache *c, const char *path)
+{
+   memset(c, 0, sizeof(*c));
+   strMapInit(&c->refs);
+   if(snprintf(c->path, sizeof(c->path), "%s", path) >= (int)sizeof(c->path) ||
+      snprintf(c->tmpPath, sizeof(c->tmpPath), "%s.tmp", path) >= (int)sizeof(c->tmpPath))
+   {
+      fprintf(stderr, "Error: attachment cache path too long: %s\n", path);
+      return 0;
+   }
+
+   size_t size;
+   if(readWholeFile(path, &c->data, &size))
+   {
+      const char *header = "txt2tex-attcache\t2\n";
+      if(strncmp(c->data, header, strlen(header)) != 0)
+      {
+         fprintf(stderr, "Warning: ignoring '%s', not an attachment cache\n", path);
+      }
+      else
+      {
+         size_t cap = 0;
+         char *line = c->data + strlen(header);
+         while(*line)
+         {
+            char *next = strchr(line, '\n');
+            if(next)
+            {
+               *next++ = '\0';
+            }
+            else
+            {
+               next = line + strlen(line);
+            }
+
+            // ref <key> <file name> <size> <mtime>
+            char *cursor = line;
+            char *kind = splitField(&cursor);
+            char *ref = splitField(&cursor);
+            char *fileName = splitField(&cursor);
+            char *fileSize = splitField(&cursor);
+            if(strcmp(kind, "ref") == 0 && *cursor != '\0')
+            {
+               if(c->entryCount == cap)
+               {
+                  cap = cap ? cap * 2 : 256;
+                  c->entries = (CachedAttachment *)realloc(c->entries, cap * sizeof(CachedAttachment));
+                  if(!c->entries)
+                  {
+                     fatal("Out of memory loading attachment cache");
+                  }
+               }
+               CachedAttachment *e = &c->entries[c->entryCount];
+               e->fileName = fileName;
+               e->fileSize = strtoll(fileSize, NULL, 10);
+               e->mtime = strtoll(cursor, NULL, 10);
+               long long *slot = strMapInsert(&c->refs, ref, (long long)c->entryCount);
+               if(*slot != (long long)c->entryCount)
+               {
+                  *slot = -1;   // Same key twice: which file belongs to which is unknown
+               }
+               c->entryCount++;
+            }
+            line = next;
+         }
+      }
+   }
+
+   c->out = fopen(c->tmpPath, "wb");
+   if(!c->out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", c->tmpPath, strerror(errno));
+      return 0;
+   }
+   fputs("txt2tex-attcache\t2\n", c->out);
+   return 1;
+}
+
+static int attachmentCacheLookup(AttachmentCache *c, AttachmentList *list, const char *ref)
+{
+   // Returns the unused, unchanged file ref resolved to last time, or -1
+   long long *entry = strMapFind(&c->refs, ref);
+   if(!entry || *entry < 0)
+   {
+      return -1;
+   }
+   const CachedAttachment *e = &c->entries[*entry];
+   int idx = findAttachmentByExactName(list, e->fileName);
+   if(idx < 0)
+   {
+      return -1;
+   }
+   const AttachmentFile *f = &list->items[idx];
+   if(f->fileSize != e->fileSize || f->mtime != e->mtime)
+   {
+      return -1;
+   }
+   c->hits++;
+   return idx;
+}
+
+static void attachmentCacheStore(AttachmentCache *c, const char *ref, const AttachmentFile *f)
+{
+   if(strpbrk(f->fileName, "\t\n"))
+   {
+      return;
+   }
+   fprintf(c->out, "ref\t%s\t%s\t%lld\t%lld\n", ref, f->fileName, f->fileSize, f->mtime);
+}
+
+static int attachmentCacheClose(AttachmentCache *c, int commit)
+{
+   // Replaces the cache file with this run's resolutions if commit is set
+   int ok = 1;
+   if(c->out)
+   {
+      ok = !ferror(c->out);
+      ok = (fclose(c->out) == 0) && ok;
+      if(commit && ok && rename(c->tmpPath, c->path) != 0)
+      {
+         fprintf(stderr, "Error: could not replace '%s': %s\n", c->path, strerror(errno));
+         ok = 0;
+      }
+      if(!commit || !ok)
+      {
+         remove(c->tmpPath);
+      }
+      else
+      {
+         fprintf(stderr, "Wrote %s (%lld matches reused)\n", c->path, c->hits);
+      }
+   }
+   free(c->entries);
+   free(c->data);
+   strMapFree(&c->refs);
+   return ok;
+}
+
+// Multi-target output (--target): the converter parses and escapes every line
+// once into shared LaTeX and HTML chunk streams held in memory; each target
+// renders the chunks on its own thread, adding only its preamble and its image
+// profile at the image positions recorded in the chunk.
+#define MaxTargets 8
+#define FanChunkLines 4096
+#define FanQueueDepth 8
+
+enum
+{
+   TargetTex,
+   TargetHtml
+};
+
+typedef struct
+{
+   size_t texOffset;    // Position of the image in the chunk streams
+   size_t htmlOffset;
+   char *fileName;
+   char *fullPath;
+   long width;          // From the image header, 0 if not read
+   long height;
+   int link;            // Non-image attachment: rendered as a link or a note
+} FanImage;
+
+typedef struct
+{
+   char *tex;           // LaTeX stream
+   size_t texLen;
+   char *html;          // HTML stream, NULL without HTML targets
+   size_t htmlLen;
+   FanImage *images;
+   size_t imageCount;
+   size_t imageCap;
+} FanChunk;
+
+struct FanOut;
+
+typedef struct
+{
+   int format;              // TargetTex or TargetHtml
+   const char *path;
+   const char *imagesDir;   // Image profile: directory of alternate images, NULL for the originals
+   int proof;               // Image profile: labelled frames instead of images
+   char linkPrefix[MaxPathLen];   // From the output's directory to the working directory, "" or ending in '/' 
+   DocumentOptions doc;     // Preamble options of this target
+   FILE *out;
+   unsigned long long consumed;   // Chunks rendered; guarded by FanOut.lock
+   int ok;
+   pthread_t thread;
+   struct FanOut *fan;
+} OutputTarget;
+
+typedef struct FanOut
+{
+   OutputTarget *targets;
+   int targetCount;
+   int needSizes;           // Some target uses the image dimensions
+   const char *title;       // HTML document title
+   FanChunk building;       // Chunk the converter is writing
+   FILE *tex;               // Memory streams of the building chunk
+   FILE *html;
+   long long lines;
+   FanChunk slots[FanQueueDepth];   // Published chunks, by sequence number
+   unsigned long long published;
+   int done;
+   pthread_mutex_t lock;
+   pthread_cond_t changed;
+} FanOut;
+
+static void fanChunkFree(FanChunk *c)
+{
+   for(size_t i = 0; i < c->imageCount; i++)
+   {
+      free(c->images[i].fileName);
+      free(c->images[i].fullPath);
+   }
+   free(c->images);
+   free(c->tex);
+   free(c->html);
+   memset(c, 0, sizeof(*c));
+}
+
+static void fanOutOpenChunk(FanOut *fan, int html)
+{
+   memset(&fan->building, 0, sizeof(fan->building));
+   fan->tex = open_memstream(&fan->building.tex, &fan->building.texLen);
+   fan->html = html ? open_memstream(&fan->building.html, &fan->building.htmlLen) : NULL;
+   if(!fan->tex || (html && !fan->html))
+   {
+      fatal("Out of memory opening output chunk");
+   }
+}
+
+static void fanOutImage(FanOut *fan, const char *fileName, const char *fullPath, int link)
+{
+   // Records an image (or an attachment link) at the current stream
+   // positions; targets render it
+   FanChunk *c = &fan->building;
+   if(c->imageCount == c->imageCap)
+   {
+      size_t cap = c->imageCap ? c->imageCap * 2 : 64;
+      FanImage *grown = (FanImage *)realloc(c->images, cap * sizeof(FanImage));
+      if(!grown)
+      {
+         fatal("Out of memory growing chunk image list");
+      }
+      c->images = grown;
+      c->imageCap = cap;
+   }
+
+   FanImage *img = &c->images[c->imageCount++];
+   img->texOffset = (size_t)ftello(fan->tex);
+   img->htmlOffset = fan->html ? (size_t)ftello(fan->html) : 0;
+   img->fileName = strdup(fileName);
+   img->fullPath = strdup(fullPath);
+   if(!img->fileName || !img->fullPath)
+   {
+      fatal("Out of memory copying image name");
+   }
+   img->width = 0;
+   img->height = 0;
+   img->link = link;
+   if(!link && fan->needSizes && !readImageSize(fullPath, &img->width, &img->height))
+   {
+      img->width = 0;
+      img->height = 0;
+   }
+}
+
+static unsigned long long fanOutMinConsumed(const FanOut *fan)
+{
+   unsigned long long min = fan->published;
+   for(int i = 0; i < fan->targetCount; i++)
+   {
+      if(fan->targets[i].consumed < min)
+      {
+         min = fan->targets[i].consumed;
+      }
+   }
+   return min;
+}
+
+static void fanOutPublish(FanOut *fan, int reopen)
+{
+   // Hands the building chunk to the targets, waiting while the slowest is FanQueueDepth chunks behind
+   int html = (fan->html != NULL);
+   fclose(fan->tex);
+   if(html)
+   {
+      fclose(fan->html);
+   }
+
+   long long waitStart = traceBegin();
+   pthread_mutex_lock(&fan->lock);
+   while(fan->published - fanOutMinConsumed(fan) >= FanQueueDepth)
+   {
+      pthread_cond_wait(&fan->changed, &fan->lock);
+   }
+   FanChunk *slot = &fan->slots[fan->published % FanQueueDepth];
+   fanChunkFree(slot);
+   *slot = fan->building;
+   fan->published++;
+   pthread_cond_broadcast(&fan->changed);
+   pthread_mutex_unlock(&fan->lock);
+   traceEnd("output", "publish", waitStart, (long long)fan->published);
+
+   if(reopen)
+   {
+      fanOutOpenChunk(fan, html);
+   }
+}
+
+// Quoted-reply deduplication (--dedup-quotes): the most recent messages, keyed
+// by a hash of sender and sent time, with an excerpt of their first text
+// line. Direct-mapped, so a colliding newer message evicts the older one.
+#define RecentMessageSlots 8192
+#define QuoteExcerptLen 60
+
+typedef struct
+{
+   uint64_t key;             // 0 if empty
+   int truncated;
+   char excerpt[QuoteExcerptLen + 1];
+} RecentMessage;
+
+enum
+{
+   QuoteNone,
+   QuoteShown,               // Quote of an unknown message, written as text
+   QuoteSkipped              // Quote replaced by a reference; its "> " lines are dropped
+};
+
+static uint64_t recentMessageKey(uint64_t senderHash, long long sent)
+{
+   uint64_t key = hashBytesFrom(senderHash, &sent, sizeof(sent));
+   return key ? key : 1;
+}
+
+static void recentMessageStore(RecentMessage *recent, uint64_t key, const char *text,
+                               const RedactMatch *matches, size_t matchCount)
+{
+   // matches are the redactions found in the whole text: the excerpt is
+   // redacted again when written, so it must not end inside one of them
+   RecentMessage *m = &recent[key & (RecentMessageSlots - 1)];
+   size_t len = strlen(text);
+   size_t cut = len;
+   if(cut > QuoteExcerptLen)
+   {
+      // Cut at a character boundary
+      cut = QuoteExcerptLen;
+      while(cut > 0 && ((unsigned char)text[cut] & 0xC0) == 0x80)
+      {
+         cut--;
+      }
+      for(size_t k = 0; k < matchCount && matches[k].start < cut; k++)
+      {
+         if(matches[k].end > cut)
+         {
+            cut = matches[k].start;
+         }
+      }
+   }
+   m->key = key;
+   m->truncated = cut < len;
+   memcpy(m->excerpt, text, cut);
+   m->excerpt[cut] = '\0';
+}
+
+static const RecentMessage *recentMessageFind(const RecentMessage *recent, uint64_t key)
+{
+   const RecentMessage *m = &recent[key & (RecentMessageSlots - 1)];
+   return (m->key == key) ? m : NULL;
+}
+
+typedef struct
+{
+   FILE *out;
+   FILE *html;               // Optional: HTML rendering of the same lines
+   FanOut *fan;              // Optional: images are recorded for the output targets
+   const DocumentOptions *doc;
+   AttachmentList *list;
+   MessageMarkList *marks;   // Optional: message boundaries and page estimates for sharding
+   AttachmentMarkList *attachmentMarks;   // Optional: output ranges of attachment blocks
+   int inHeader;             // Previous line belonged to a message header
+   char **planned;           // Optional: file name per attachment reference ("" = unmatched)
+   size_t plannedCount;
+   size_t plannedNext;
+   Redactor *redactor;       // Optional: redaction stage ahead of escaping
+   AttachmentCache *cache;   // Optional: attachment resolutions of the previous run
+   Analytics *analytics;     // Optional: conversation statistics for --analytics
+   SearchIndex *index;       // Optional: terms of the written text lines for --index
+   const SizeTolerance *tolerance;   // Optional: approximate size matching
+   long long msgSent;        // Sent time of the current message, -1 if unknown
+   RecentMessage *recent;    // Optional: emitted messages for --dedup-quotes
+   uint64_t msgSender;       // Hash of the current message's sender, for recent
+   int msgRecorded;          // Current message is in recent
+   int quoteState;           // QuoteNone, QuoteShown or QuoteSkipped
+   uint64_t msgKey;          // Hash of the From/Sent lines of the current message, for the cache
+   int attOrdinal;           // Attachment references seen in the current message
+   ConvertStats stats;
+} Converter;
+
+static void converterInit(Converter *cv, FILE *out, const DocumentOptions *doc, AttachmentList *list, MessageMarkList *marks)
+{
+   cv->out = out;
+   cv->html = NULL;
+   cv->fan = NULL;
+   cv->doc = doc;
+   cv->list = list;
+   cv->marks = marks;
+   cv->inHeader = 0;
+   cv->planned = NULL;
+   cv->plannedCount = 0;
+   cv->plannedNext = 0;
+   cv->redactor = NULL;
+   cv->cache = NULL;
+   cv->analytics = NULL;
+   cv->index = NULL;
+   cv->attachmentMarks = NULL;
+   cv->tolerance = NULL;
+   cv->msgSent = -1;
+   cv->recent = NULL;
+   cv->msgSender = 0;
+   cv->msgRecorded = 0;
+   cv->quoteState = QuoteNone;
+   cv->msgKey = HashSeed;
+   cv->attOrdinal = 0;
+   memset(&cv->stats, 0, sizeof(cv->stats));
+}
+
+static void converterAddLines(Converter *cv, double lines)
+{
+   if(cv->marks && cv->marks->count > 0)
+   {
+      cv->marks->items[cv->marks->count - 1].pages += lines / EstLinesPerPage;
+   }
+}
+
+static void converterWriteText(Converter *cv, const char *text)
+{
+   // Escapes (and redacts) text into the outputs without counting redactions
+   if(cv->redactor)
+   {
+      long long counts[RedactKindCount] = { 0 };
+      writeRedacted(cv->out, cv->html, cv->doc, cv->redactor, text, counts);
+   }
+   else
+   {
+      writeLatexEscaped(cv->out, cv->doc, text);
+      if(cv->html)
+      {
+         writeHtmlEscapedLen(cv->html, text, strlen(text));
+      }
+   }
+}
+
+static int converterQuote(Converter *cv, const char *line)
+{
+   // Writes a "Quote:" line that refers to an already emitted message as a
+   // short reference and drops the quoted lines that follow; returns 0 if
+   // the line should be written as text
+   const char *sender;
+   const char *timeText;
+   size_t senderLen;
+   long long sent = parseQuoteHeader(line, &sender, &senderLen, &timeText);
+   const RecentMessage *m = NULL;
+   if(sent >= 0)
+   {
+      m = recentMessageFind(cv->recent, recentMessageKey(hashBytes(sender, senderLen), sent));
+   }
+   if(!m)
+   {
+      cv->quoteState = QuoteShown;
+      return 0;
+   }
+   cv->quoteState = QuoteSkipped;
+   cv->stats.quotesCollapsed++;
+   cv->stats.quoteBytesSkipped += (long long)strlen(line) + 1;
+
+   char ref[512];
+   snprintf(ref, sizeof(ref), "%.*s, %s", (int)senderLen, sender, timeText);
+   fputs("\\textit{Reply to ", cv->out);
+   if(cv->html)
+   {
+      fputs("<i>Reply to ", cv->html);
+   }
+   converterWriteText(cv, ref);
+   fputs(":} ", cv->out);
+   if(cv->html)
+   {
+      fputs(":</i> ", cv->html);
+   }
+   converterWriteText(cv, m->excerpt);
+   fputs(m->truncated ? "\\dots{}\\\\\n" : "\\\\\n", cv->out);
+   if(cv->html)
+   {
+      fputs(m->truncated ? "&hellip;<br>\n" : "<br>\n", cv->html);
+   }
+   converterAddLines(cv, estimateTextLines(ref) + estimateTextLines(m->excerpt));
+   return 1;
+}
+
+static void convertLine(Converter *cv, char *line)
+{
+   FILE *out = cv->out;
+   FILE *html = cv->html;
+   AttachmentList *list = cv->list;
+
+   // Remove trailing newline/space early
+   trimRight(line);
+   cv->stats.lines++;
+
+   // Track message boundaries: a header line following a non-header line starts a message
+   int kind = classifyLine(line);
+   int flags = lineRules[kind].flags;
+   int isHeader = (flags & LineHeader) != 0;
+   if((flags & LineStart) && !cv->inHeader)
+   {
+      if(cv->marks)
+      {
+         messageMarkListPush(cv->marks, (long long)ftello(out), cv->stats.lines);
+      }
+      cv->msgKey = HashSeed;
+      cv->attOrdinal = 0;
+      cv->msgSent = -1;
+      cv->msgSender = 0;
+      cv->msgRecorded = 0;
+      cv->quoteState = QuoteNone;
+      if(cv->index)
+      {
+         searchIndexMessage(cv->index, (long long)ftello(out), 1);
+      }
+   }
+   cv->inHeader = isHeader;
+
+   if((cv->tolerance || cv->recent) && kind == LineSent)
+   {
+      cv->msgSent = parseSentTime(line, NULL);
+   }
+
+   if(cv->cache && (kind == LineFrom || kind == LineSent))
+   {
+      // Message key for the attachment cache; the lines end up only in the hash
+      cv->msgKey = hashBytesFrom(cv->msgKey, line, strlen(line) + 1);
+   }
+
+   // Suppress unwanted metadata lines
+   if(flags & LineSkipped)
+   {
+      return;
+   }
+
+   if(kind == LineFrom)
+   {
+      stripPhoneFromFromLine(line);
+   }
+
+   if(cv->analytics)
+   {
+      analyticsLine(cv->analytics, kind, line);
+   }
+
+   if(cv->recent)
+   {
+      if(kind == LineFrom)
+      {
+         const char *name = line + strlen("From:");
+         name += strspn(name, " ");
+         cv->msgSender = hashBytes(name, strlen(name));
+      }
+      if(cv->quoteState != QuoteNone && line[0] == '>')
+      {
+         if(cv->quoteState == QuoteSkipped)
+         {
+            cv->stats.quoteBytesSkipped += (long long)strlen(line) + 1;
+            return;
+         }
+      }
+      else
+      {
+         cv->quoteState = QuoteNone;
+      }
+      if(kind == LineQuote && converterQuote(cv, line))
+      {
+         return;
+      }
+   }
+
+   // Keep original newline behaviour: we escape content but preserve line breaks
+   if(kind == LineAttachment)
+   {
+      char attMime[128];
+      int idx;
+      long long sizeDiff = 0;
+      long long matchStart = traceBegin();
+      if(cv->planned)
+      {
+         // Worker mode: the plan already resolved this reference
+         char attName[MaxPathLen];
+         long long attBytes = -1;
+         int hasName = 0;
+         parseAttachmentLine(line, attName, sizeof(attName), attMime, sizeof(attMime), &attBytes, &hasName);
+
+         const char *planned = (cv->plannedNext < cv->plannedCount) ? cv->planned[cv->plannedNext] : "";
+         cv->plannedNext++;
+         idx = (planned[0] != '\0') ? findAttachmentByExactName(list, planned) : -1;
+      }
+      else if(cv->cache)
+      {
+         // The reference line tells apart messages with the same From/Sent lines
+         int ordinal = cv->attOrdinal++;
+         uint64_t key = hashBytesFrom(cv->msgKey, &ordinal, sizeof(ordinal));
+         key = hashBytesFrom(key, line, strlen(line));
+         char ref[24];
+         snprintf(ref, sizeof(ref), "%016llx", (unsigned long long)key);
+         idx = attachmentCacheLookup(cv->cache, list, ref);
+         if(idx >= 0)
+         {
+            char attName[MaxPathLen];
+            long long attBytes = -1;
+            int hasName = 0;
+            parseAttachmentLine(line, attName, sizeof(attName), attMime, sizeof(attMime), &attBytes, &hasName);
+         }
+         else
+         {
+            idx = matchAttachment(list, line, cv->tolerance, cv->msgSent, attMime, sizeof(attMime), &sizeDiff);
+         }
+         if(idx >= 0)
+         {
+            attachmentCacheStore(cv->cache, ref, &list->items[idx]);
+         }
+      }
+      else
+      {
+         idx = matchAttachment(list, line, cv->tolerance, cv->msgSent, attMime, sizeof(attMime), &sizeDiff);
+      }
+      traceEnd("attachment", "match", matchStart, -1);
+
+      if(sizeDiff > 0)
+      {
+         fprintf(stderr, "Approximate match (input line %lld): %s -> %s (%lld bytes off)\n", cv->stats.lines,
+                 line + strspn(line + strlen("Attachment:"), " ") + strlen("Attachment:"), list->items[idx].fileName, sizeDiff);
+         cv->stats.attachmentsApproximate++;
+         if(sizeDiff > cv->stats.approximateMaxDiff)
+         {
+            cv->stats.approximateMaxDiff = sizeDiff;
+         }
+      }
+
+      long long blockStart = cv->attachmentMarks ? (long long)ftello(out) : 0;
+      const char *included = NULL;
+      if(idx >= 0)
+      {
+         list->items[idx].used = 1;
+         cv->stats.attachmentsMatched++;
+
+         char relPath[MaxPathLen];
+         snprintf(relPath, sizeof(relPath), "attachments/%s", list->items[idx].fileName);
+
+         if(isImageMime(attMime) || hasImageExtension(list->items[idx].fileName))
+         {
+            if(cv->fan)
+            {
+               fanOutImage(cv->fan, list->items[idx].fileName, list->items[idx].fullPath, 0);
+            }
+            else
+            {
+               writeImageInclude(out, relPath, list->items[idx].fullPath, cv->doc->proof);
+               included = cv->doc->proof ? NULL : list->items[idx].fullPath;
+            }
+            if(cv->marks)
+            {
+               converterAddLines(cv, estimateImageLines(list->items[idx].fullPath));
+            }
+         }
+         else
+         {
+            if(cv->fan)
+            {
+               // The path depends on where each target is written
+               fanOutImage(cv->fan, list->items[idx].fileName, list->items[idx].fullPath, 1);
+            }
+            else
+            {
+               writeNonImageAttachment(out, relPath);
+            }
+            converterAddLines(cv, 4.0);
+         }
+      }
+      else
+      {
+         // Could not match: keep a note in output
+         cv->stats.attachmentsUnmatched++;
+         fputs("\n\\begin{quote}\n", out);
+         fputs("\\textbf{Unmatched attachment placeholder:} ", out);
+         if(html)
+         {
+            fputs("<b>Unmatched attachment placeholder:</b> ", html);
+         }
+         if(cv->redactor)
+         {
+            // The reference carries the original file name, which may name people
+            writeRedacted(out, html, cv->doc, cv->redactor, line, cv->stats.redactions);
+         }
+         else
+         {
+            writeLatexEscaped(out, cv->doc, line);
+            if(html)
+            {
+               writeHtmlEscapedLen(html, line, strlen(line));
+            }
+         }
+         fputs("\\end{quote}\n\n", out);
+         if(html)
+         {
+            fputs("<br>\n", html);
+         }
+         converterAddLines(cv, 3.0 + estimateTextLines(line));
+      }
+
+      if(cv->attachmentMarks)
+      {
+         char label[MaxPathLen + 16];
+         snprintf(label, sizeof(label), "%s%s", (idx >= 0) ? "attachments/" : "", (idx >= 0) ? list->items[idx].fileName : line);
+         attachmentMarkListPush(cv->attachmentMarks, blockStart, (long long)ftello(out), cv->stats.lines, label, included);
+      }
+      return;
+   }
+
+   // Normal text line
+   trimRight(line);
+
+   if(line[0] == '\0')
+   {
+      fputs("\n\n", out);   // Paragraph break in LaTeX
+      if(html)
+      {
+         fputs("</p>\n<p>\n", html);
+      }
+   }
+   else
+   {
+      size_t matchCount = 0;
+      if(cv->redactor)
+      {
+         matchCount = writeRedacted(out, html, cv->doc, cv->redactor, line, cv->stats.redactions);
+      }
+      else
+      {
+         writeLatexEscaped(out, cv->doc, line);
+         if(html)
+         {
+            writeHtmlEscapedLen(html, line, strlen(line));
+         }
+      }
+      if(cv->index)
+      {
+         searchIndexLine(cv->index, line, strlen(line), cv->redactor, matchCount, cv->stats.lines);
+      }
+      if(cv->recent && !cv->msgRecorded && kind == LineText && cv->quoteState == QuoteNone && cv->msgSender && cv->msgSent >= 0)
+      {
+         // The first text line of a message is its excerpt in later quotes
+         recentMessageStore(cv->recent, recentMessageKey(cv->msgSender, cv->msgSent), line,
+                            cv->redactor ? cv->redactor->matches : NULL, matchCount);
+         cv->msgRecorded = 1;
+      }
+      fputs("\\\\\n", out); // Keep forced line breaks only for non-empty lines
+      if(html)
+      {
+         fputs("<br>\n", html);
+      }
+   }
+   converterAddLines(cv, estimateTextLines(line));
+}
+
+static void convertRange(Converter *cv, FILE *in, long long start, long long end)
+{
+   // Converts the lines in [start, end); a negative end means up to end of file
+   char line[8192];
+   long long pos = start;
+   if(start > 0)
+   {
+      fseeko(in, (off_t)start, SEEK_SET);
+   }
+
+   // Traced in chunks of 4096 lines
+   long long chunkStart = traceBegin();
+   long long chunkLines = 0;
+   while((end < 0 || pos < end) && fgets(line, (int)sizeof(line), in))
+   {
+      pos += (long long)strlen(line);
+      convertLine(cv, line);
+
+      if(cv->fan && ++cv->fan->lines % FanChunkLines == 0)
+      {
+         fanOutPublish(cv->fan, 1);
+         cv->out = cv->fan->tex;
+         cv->html = cv->fan->html;
+      }
+
+      if(traceEnabled && ++chunkLines == 4096)
+      {
+         traceEnd("convert", "chunk", chunkStart, chunkLines);
+         chunkStart = traceBegin();
+         chunkLines = 0;
+      }
+   }
+   if(chunkLines > 0)
+   {
+      traceEnd("convert", "chunk", chunkStart, chunkLines);
+   }
+}
+
+static void writePreamble(FILE *out, const DocumentOptions *doc)
+{
+   // Minimal LaTeX wrapper
+   fputs("\\documentclass[a4paper,11pt]{article}\n", out);
+   fputs("\\usepackage[margin=25mm]{geometry}\n", out);
+   fputs("\\usepackage{graphicx}\n", out);
+
+   if(doc->engine == EnginePdfLatex)
+   {
+      fputs("\\usepackage[T1]{fontenc}\n", out);
+      fputs("\\usepackage[utf8]{inputenc}\n", out);
+      fputs("\\usepackage{lmodern}\n", out);
+      fputs("\\usepackage{textcomp}\n", out);
+
+      // Emoji and other codepoints without a T1 glyph: image or placeholder
+      fputs("\\newcommand{\\emojiimg}[1]{\\raisebox{-0.15em}{\\includegraphics[height=1em]{#1}}}\n", out);
+      fputs("\\newcommand{\\missingglyph}[1]{\\fbox{\\tiny U+#1}}\n", out);
+   }
+   else
+   {
+      fputs("\\usepackage{fontspec}\n", out);
+      fputs("\\setmainfont{Latin Modern Roman}\n", out);
+
+      // Emoji font 
+      // Linux:
+      // fputs("\\newfontfamily\\emojifont{Noto Color Emoji}\n", out);
+      // Windows:
+      fputs("\\newfontfamily\\emojifont{Segoe UI Emoji}\n", out);
+
+      fputs("\\DeclareTextFontCommand{\\emoji}{\\emojifont}\n", out);
+   }
+   // fputs("\\usepackage{ragged2e}\n", out);
+   // fputs("\\AtBeginDocument{\\RaggedRight}\n", out);
+   fputs("\\setlength{\\emergencystretch}{3em}\n", out);
+
+   if(doc->redact)
+   {
+      fputs("\\newcommand{\\redacted}[1]{\\textbf{[#1]}}\n", out);
+   }
+   if(doc->redact && doc->highlight)
+   {
+      fputs("\\usepackage{xcolor}\n", out);
+      fputs("\\newcommand{\\reviewmark}[1]{\\colorbox{yellow}{#1}}\n", out);
+   }
+
+   if(doc->proof)
+   {
+      // \proofimage{<height/width>}{<width px>}{<height px>}{<label>}: a frame
+      // sized like \includegraphics[width=\linewidth,height=0.9\textheight,keepaspectratio]
+      fputs("\\newlength{\\proofw}\n", out);
+      fputs("\\newlength{\\proofh}\n", out);
+      fputs("\\newcommand{\\proofimage}[4]{%\n", out);
+      fputs("\\setlength{\\proofw}{\\linewidth}%\n", out);
+      fputs("\\setlength{\\proofh}{#1\\linewidth}%\n", out);
+      fputs("\\ifdim\\proofh>0.9\\textheight\n", out);
+      fputs("\\setlength{\\proofh}{0.9\\textheight}%\n", out);
+      fputs("\\setlength{\\proofw}{\\dimexpr\\proofh*#2/#3\\relax}%\n", out);
+      fputs("\\fi\n", out);
+      fputs("\\raisebox{\\fboxrule}{\\setlength{\\fboxsep}{0pt}\\fbox{\\parbox[b][\\dimexpr\\proofh-2\\fboxrule\\relax][c]{\\dimexpr\\proofw-2\\fboxrule\\relax}{\\centering\\scriptsize #4}}}}\n", out);
+   }
+}
+
+static void targetLinkPrefix(const char *outPath, char *prefix, size_t cap)
+{
+   // Attachment paths are relative to the working directory; an HTML page or
+   // a LaTeX document resolves them relative to its own directory, so prefix
+   // them with the way from there to the working directory ("../", ...)
+   prefix[0] = '\0';
+   const char *slash = strrchr(outPath, '/');
+   if(!slash)
+   {
+      return;
+   }
+   char dir[MaxPathLen];
+   snprintf(dir, sizeof(dir), "%.*s", (int)(slash - outPath), outPath);
+   char *from = realpath((slash == outPath) ? "/" : dir, NULL);
+   char *cwd = realpath(".", NULL);
+   char fromDir[MaxPathLen + 1];
+   char cwdDir[MaxPathLen + 1];
+   if(!from || !cwd || strlen(from) >= MaxPathLen || strlen(cwd) >= MaxPathLen)
+   {
+      fprintf(stderr, "Warning: attachment paths in '%s' are relative to the working directory\n", outPath);
+      free(from);
+      free(cwd);
+      return;
+   }
+   // With a trailing slash on both, the common part ends at a shared '/'
+   snprintf(fromDir, sizeof(fromDir), "%s%s", from, (strcmp(from, "/") == 0) ? "" : "/");
+   snprintf(cwdDir, sizeof(cwdDir), "%s%s", cwd, (strcmp(cwd, "/") == 0) ? "" : "/");
+   free(from);
+   free(cwd);
+
+   size_t common = 0;
+   for(size_t i = 0; fromDir[i] && fromDir[i] == cwdDir[i]; i++)
+   {
+      if(fromDir[i] == '/')
+      {
+         common = i + 1;
+      }
+   }
+   size_t used = 0;
+   for(const char *p = fromDir + common; *p; p++)
+   {
+      if(*p == '/' && used + 3 < cap)
+      {
+         memcpy(prefix + used, "../", 3);
+         used += 3;
+      }
+   }
+   snprintf(prefix + used, cap - used, "%s", cwdDir + common);
+}
+
+static void targetWriteImage(OutputTarget *t, const FanImage *img)
+{
+   FILE *out = t->out;
+   char relPath[MaxPathLen * 2];
+   snprintf(relPath, sizeof(relPath), "attachments/%s", img->fileName);
+   if(t->imagesDir)
+   {
+      // Alternate image of the same name, e.g. downscaled for screen reading
+      char altPath[MaxPathLen * 2];
+      struct stat st;
+      snprintf(altPath, sizeof(altPath), "%s/%s", t->imagesDir, img->fileName);
+      if(stat(altPath, &st) == 0 && S_ISREG(st.st_mode))
+      {
+         snprintf(relPath, sizeof(relPath), "%s", altPath);
+      }
+   }
+
+   char path[MaxPathLen * 3];
+   snprintf(path, sizeof(path), "%s%s", (relPath[0] == '/') ? "" : t->linkPrefix, relPath);
+
+   if(t->format == TargetHtml)
+   {
+      if(img->link)
+      {
+         fputs("<b>Attachment:</b> <a href=\"", out);
+         writeHtmlEscapedLen(out, path, strlen(path));
+         fputs("\">", out);
+         writeHtmlEscapedLen(out, relPath, strlen(relPath));
+         fputs("</a><br>\n", out);
+         return;
+      }
+      fputs("<img src=\"", out);
+      writeHtmlEscapedLen(out, path, strlen(path));
+      fputs("\" alt=\"", out);
+      writeHtmlEscapedLen(out, img->fileName, strlen(img->fileName));
+      fputc('"', out);
+      if(img->width > 0 && img->height > 0)
+      {
+         fprintf(out, " width=\"%ld\" height=\"%ld\"", img->width, img->height);
+      }
+      fputs(" loading=\"lazy\"><br>\n", out);
+   }
+   else if(img->link)
+   {
+      writeNonImageAttachment(out, path);
+   }
+   else if(t->proof)
+   {
+      writeImageIncludeSized(out, path, img->width, img->height);
+   }
+   else
+   {
+      writeImageIncludeSized(out, path, 0, 0);
+   }
+}
+
+static void targetWriteChunk(OutputTarget *t, const FanChunk *c)
+{
+   int html = (t->format == TargetHtml);
+   const char *data = html ? c->html : c->tex;
+   size_t len = html ? c->htmlLen : c->texLen;
+   size_t pos = 0;
+
+   for(size_t i = 0; i < c->imageCount; i++)
+   {
+      size_t at = html ? c->images[i].htmlOffset : c->images[i].texOffset;
+      fwrite(data + pos, 1, at - pos, t->out);
+      targetWriteImage(t, &c->images[i]);
+      pos = at;
+   }
+   fwrite(data + pos, 1, len - pos, t->out);
+}
+
+static void *targetThread(void *arg)
+{
+   OutputTarget *t = (OutputTarget *)arg;
+   FanOut *fan = t->fan;
+
+   if(t->format == TargetHtml)
+   {
+      fputs("<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>", t->out);
+      writeHtmlEscapedLen(t->out, fan->title, strlen(fan->title));
+      fputs("</title>\n<style>\n", t->out);
+      fputs("body { max-width: 48em; margin: 2em auto; padding: 0 1em; font-family: sans-serif; line-height: 1.4; }\n", t->out);
+      fputs("img { max-width: 100%; height: auto; }\n", t->out);
+      fputs("</style>\n</head>\n<body>\n<p>\n", t->out);
+   }
+   else
+   {
+      writePreamble(t->out, &t->doc);
+      fputs("\\begin{document}\n\n", t->out);
+   }
+
+   for(;;)
+   {
+      pthread_mutex_lock(&fan->lock);
+      while(t->consumed == fan->published && !fan->done)
+      {
+         pthread_cond_wait(&fan->changed, &fan->lock);
+      }
+      if(t->consumed == fan->published)
+      {
+         pthread_mutex_unlock(&fan->lock);
+         break;
+      }
+      // The slot is not reused before this target has consumed it
+      const FanChunk *chunk = &fan->slots[t->consumed % FanQueueDepth];
+      pthread_mutex_unlock(&fan->lock);
+
+      long long renderStart = traceBegin();
+      targetWriteChunk(t, chunk);
+      traceEnd("output", (t->format == TargetHtml) ? "html chunk" : "tex chunk", renderStart, (long long)chunk->imageCount);
+
+      pthread_mutex_lock(&fan->lock);
+      t->consumed++;
+      pthread_cond_broadcast(&fan->changed);
+      pthread_mutex_unlock(&fan->lock);
+   }
+
+   fputs((t->format == TargetHtml) ? "</p>\n</body>\n</html>\n" : "\n\\end{document}\n", t->out);
+   t->ok = !ferror(t->out);
+   t->ok = (fclose(t->out) == 0) && t->ok;
+   return NULL;
+}
+
+static const char *findBytes(const char *hay, size_t hayLen, const char *needle)
+{
+   size_t n = strlen(needle);
+   for(size_t i = 0; i + n <= hayLen; i++)
+   {
+      if(hay[i] == needle[0] && memcmp(hay + i, needle, n) == 0)
+      {
+         return hay + i;
+      }
+   }
+   return NULL;
+}
+
+// Minimal PDF reader/merger for the shard PDFs written by the engine. Shards are
+// compiled with object streams disabled, so every file has a classic xref table.
+typedef struct
+{
+   char *data;
+   size_t size;
+   long long *offsets;   // Byte offset of each object, -1 if free
+   int *gens;
+   int objCount;         // Trailer /Size
+   int rootPages;        // Object number of the page tree root
+   int pageCount;
+   int info;             // Trailer /Info dictionary, -1 if none
+} PdfFile;
+
+static int pdfIsWhite(unsigned char c)
+{
+   return c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ';
+}
+
+static int pdfIsDelim(unsigned char c)
+{
+   return c != 0 && strchr("()<>[]{}/%", c) != NULL;
+}
+
+static int pdfParseRefAt(const char *p, const char *end, int *outNum, int *outGen, const char **outAfter)
+{
+   // Matches "<num> <gen> R" followed by whitespace or a delimiter
+   const char *q = p;
+   long num = 0;
+   long gen = 0;
+
+   if(q >= end || !isdigit((unsigned char)*q))
+   {
+      return 0;
+   }
+   while(q < end && isdigit((unsigned char)*q))
+   {
+      num = num * 10 + (*q++ - '0');
+   }
+   if(q >= end || !pdfIsWhite((unsigned char)*q))
+   {
+      return 0;
+   }
+   while(q < end && pdfIsWhite((unsigned char)*q))
+   {
+      q++;
+   }
+   if(q >= end || !isdigit((unsigned char)*q))
+   {
+      return 0;
+   }
+   while(q < end && isdigit((unsigned char)*q))
+   {
+      gen = gen * 10 + (*q++ - '0');
+   }
+   if(q >= end || !pdfIsWhite((unsigned char)*q))
+   {
+      return 0;
+   }
+   while(q < end && pdfIsWhite((unsigned char)*q))
+   {
+      q++;
+   }
+   if(q >= end || *q != 'R')
+   {
+      return 0;
+   }
+   q++;
+   if(q < end && !pdfIsWhite((unsigned char)*q) && !pdfIsDelim((unsigned char)*q))
+   {
+      return 0;
+   }
+
+   *outNum = (int)num;
+   *outGen = (int)gen;
+   *outAfter = q;
+   return 1;
+}
+
+static const char *pdfObjectText(const PdfFile *pdf, int num, const char **outEnd)
+{
+   // Returns the text of a (non-stream) object, from "N G obj" up to "endobj"
+   if(num <= 0 || num >= pdf->objCount || pdf->offsets[num] < 0)
+   {
+      return NULL;
+   }
+   const char *start = pdf->data + pdf->offsets[num];
+   const char *end = findBytes(start, pdf->size - (size_t)pdf->offsets[num], "endobj");
+   if(!end)
+   {
+      return NULL;
+   }
+   *outEnd = end;
+   return start;
+}
+
+static const char *pdfFindKey(const char *start, const char *end, const char *key)
+{
+   size_t n = strlen(key);
+   for(const char *p = findBytes(start, (size_t)(end - start), key); p; p = findBytes(p + 1, (size_t)(end - p - 1), key))
+   {
+      unsigned char next = (unsigned char)p[n];
+      if(pdfIsWhite(next) || pdfIsDelim(next))
+      {
+         return p + n;
+      }
+   }
+   return NULL;
+}
+
+static int pdfLookupRef(const char *start, const char *end, const char *key)
+{
+   const char *p = pdfFindKey(start, end, key);
+   int num = 0;
+   int gen = 0;
+   const char *after;
+   if(!p)
+   {
+      return -1;
+   }
+   while(p < end && pdfIsWhite((unsigned char)*p))
+   {
+      p++;
+   }
+   return pdfParseRefAt(p, end, &num, &gen, &after) ? num : -1;
+}
+
+static void pdfFree(PdfFile *pdf)
+{
+   free(pdf->data);
+   free(pdf->offsets);
+   free(pdf->gens);
+   memset(pdf, 0, sizeof(*pdf));
+}
+
+static int pdfLoad(const char *path, PdfFile *pdf)
+{
+   memset(pdf, 0, sizeof(*pdf));
+   if(!readWholeFile(path, &pdf->data, &pdf->size))
+   {
+      fprintf(stderr, "Error: could not read '%s': %s\n", path, strerror(errno));
+      return 0;
+   }
+
+   const char *data = pdf->data;
+   const char *end = data + pdf->size;
+
+   // The last "startxref" sits in the final kilobyte of the file
+   const char *startxref = NULL;
+   size_t tailStart = (pdf->size > 1024) ? pdf->size - 1024 : 0;
+   for(const char *p = findBytes(data + tailStart, pdf->size - tailStart, "startxref"); p; p = findBytes(p + 1, (size_t)(end - p - 1), "startxref"))
+   {
+      startxref = p;
+   }
+   if(!startxref)
+   {
+      fprintf(stderr, "Error: '%s' has no startxref\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+
+   long long xrefOff = strtoll(startxref + 9, NULL, 10);
+   if(xrefOff <= 0 || (size_t)xrefOff >= pdf->size || strncmp(data + xrefOff, "xref", 4) != 0)
+   {
+      fprintf(stderr, "Error: '%s' uses a cross-reference stream, which is not supported\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+
+   const char *trailer = findBytes(data + xrefOff, (size_t)(startxref - data - xrefOff), "trailer");
+   if(!trailer)
+   {
+      fprintf(stderr, "Error: '%s' has no trailer\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+
+   const char *sizeVal = pdfFindKey(trailer, startxref, "/Size");
+   int catalog = pdfLookupRef(trailer, startxref, "/Root");
+   if(!sizeVal || catalog < 0 || pdfFindKey(trailer, startxref, "/Prev"))
+   {
+      fprintf(stderr, "Error: '%s' has an unsupported trailer\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+
+   pdf->info = pdfLookupRef(trailer, startxref, "/Info");
+   pdf->objCount = (int)strtol(sizeVal, NULL, 10);
+   if(pdf->objCount <= 0)
+   {
+      fprintf(stderr, "Error: '%s' has an invalid /Size\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+   pdf->offsets = (long long *)malloc((size_t)pdf->objCount * sizeof(long long));
+   pdf->gens = (int *)calloc((size_t)pdf->objCount, sizeof(int));
+   if(!pdf->offsets || !pdf->gens)
+   {
+      fatal("Out of memory reading PDF cross-reference table");
+   }
+   for(int i = 0; i < pdf->objCount; i++)
+   {
+      pdf->offsets[i] = -1;
+   }
+
+   // Subsections: "<first> <count>" followed by "<offset> <gen> <n|f>" entries
+   const char *p = data + xrefOff + 4;
+   while(p < trailer)
+   {
+      char *e;
+      long first = strtol(p, &e, 10);
+      if(e == p)
+      {
+         break;
+      }
+      long count = strtol(e, &e, 10);
+      for(long i = 0; i < count; i++)
+      {
+         long long off = strtoll(e, &e, 10);
+         long gen = strtol(e, &e, 10);
+         while(*e == ' ')
+         {
+            e++;
+         }
+         char type = *e++;
+         if(type == 'n' && first + i < pdf->objCount)
+         {
+            pdf->offsets[first + i] = off;
+            pdf->gens[first + i] = (int)gen;
+         }
+      }
+      p = e;
+   }
+
+   const char *objEnd;
+   const char *obj = pdfObjectText(pdf, catalog, &objEnd);
+   pdf->rootPages = obj ? pdfLookupRef(obj, objEnd, "/Pages") : -1;
+   obj = pdfObjectText(pdf, pdf->rootPages, &objEnd);
+   const char *countVal = obj ? pdfFindKey(obj, objEnd, "/Count") : NULL;
+   if(!countVal)
+   {
+      fprintf(stderr, "Error: '%s' has no readable page tree\n", path);
+      pdfFree(pdf);
+      return 0;
+   }
+   pdf->pageCount = (int)strtol(countVal, NULL, 10);
+   return 1;
+}
+
+static const char *pdfCopyToken(FILE *out, const char *p, const char *end)
+{
+   // Copies a string, comment, name or plain token verbatim
+   const char *start = p;
+   if(*p == '(')
+   {
+      int depth = 0;
+      while(p < end)
+      {
+         if(*p == '\\')
+         {
+            p += 2;
+            continue;
+         }
+         if(*p == '(')
+         {
+            depth++;
+         }
+         else if(*p == ')' && --depth == 0)
+         {
+            p++;
+            break;
+         }
+         p++;
+      }
+   }
+   else if(*p == '<')
+   {
+      while(p < end && *p != '>')
+      {
+         p++;
+      }
+      p++;
+   }
+   else if(*p == '%')
+   {
+      while(p < end && *p != '\n' && *p != '\r')
+      {
+         p++;
+      }
+   }
+   else
+   {
+      p++;
+      while(p < end && !pdfIsWhite((unsigned char)*p) && !pdfIsDelim((unsigned char)*p))
+      {
+         p++;
+      }
+   }
+   if(p > end)
+   {
+      p = end;
+   }
+   fwrite(start, 1, (size_t)(p - start), out);
+   return p;
+}
+
+static int pdfCopyObject(FILE *out, const PdfFile *pdf, int num, int base, int parent)
+{
+   // Copies object `num`, renumbering indirect references by `base`. When
+   // `parent` is positive a /Parent entry is added to the top-level dictionary.
+   const char *end = pdf->data + pdf->size;
+   char *p;
+   strtol(pdf->data + pdf->offsets[num], &p, 10);
+   strtol(p, &p, 10);
+   while(p < end && pdfIsWhite((unsigned char)*p))
+   {
+      p++;
+   }
+   if(strncmp(p, "obj", 3) != 0)
+   {
+      return 0;
+   }
+   fprintf(out, "%d %d obj", num + base, pdf->gens[num]);
+
+   const char *q = p + 3;
+   int depth = 0;
+   int afterLength = 0;
+   long long length = -1;
+   int lengthRef = -1;
+
+   while(q < end)
+   {
+      unsigned char c = (unsigned char)*q;
+      if(pdfIsWhite(c) || c == '[' || c == ']' || c == '{' || c == '}')
+      {
+         fputc(c, out);
+         q++;
+         continue;
+      }
+      if(c == '<' && q + 1 < end && q[1] == '<')
+      {
+         fputs("<<", out);
+         q += 2;
+         depth++;
+         if(parent > 0)
+         {
+            fprintf(out, " /Parent %d 0 R", parent);
+            parent = 0;
+         }
+         continue;
+      }
+      if(c == '>' && q + 1 < end && q[1] == '>')
+      {
+         fputs(">>", out);
+         q += 2;
+         depth--;
+         continue;
+      }
+      if(c == '(' || c == '<' || c == '%')
+      {
+         q = pdfCopyToken(out, q, end);
+         afterLength = 0;
+         continue;
+      }
+      if(c == '/')
+      {
+         const char *name = q;
+         q = pdfCopyToken(out, q, end);
+         afterLength = (depth == 1 && q - name == 7 && memcmp(name, "/Length", 7) == 0);
+         continue;
+      }
+      if(isdigit(c))
+      {
+         int refNum;
+         int refGen;
+         const char *after;
+         if(pdfParseRefAt(q, end, &refNum, &refGen, &after))
+         {
+            fprintf(out, "%d %d R", refNum + base, refGen);
+            if(afterLength)
+            {
+               lengthRef = refNum;
+            }
+            q = after;
+         }
+         else
+         {
+            if(afterLength)
+            {
+               length = strtoll(q, NULL, 10);
+            }
+            q = pdfCopyToken(out, q, end);
+         }
+         afterLength = 0;
+         continue;
+      }
+      if(isalpha(c))
+      {
+         if(strncmp(q, "endobj", 6) == 0)
+         {
+            fputs("endobj\n", out);
+            return 1;
+         }
+         if(strncmp(q, "stream", 6) == 0)
+         {
+            break;
+         }
+      }
+      q = pdfCopyToken(out, q, end);
+      afterLength = 0;
+   }
+
+   if(q >= end)
+   {
+      return 0;
+   }
+
+   // Stream data is copied raw; its length may itself be an indirect object
+   if(lengthRef >= 0)
+   {
+      const char *lenEnd;
+      const char *lenObj = pdfObjectText(pdf, lengthRef, &lenEnd);
+      if(lenObj)
+      {
+         const char *v = strstr(lenObj, "obj");
+         length = v ? strtoll(v + 3, NULL, 10) : -1;
+      }
+   }
+
+   const char *data = q + 6;
+   if(data < end && *data == '\r')
+   {
+      data++;
+   }
+   if(data < end && *data == '\n')
+   {
+      data++;
+   }
+
+   const char *dataEnd;
+   if(length >= 0 && data + length <= end)
+   {
+      dataEnd = data + length;
+   }
+   else
+   {
+      dataEnd = findBytes(data, (size_t)(end - data), "endstream");
+   }
+   const char *objEnd = dataEnd ? findBytes(dataEnd, (size_t)(end - dataEnd), "endobj") : NULL;
+   if(!objEnd)
+   {
+      return 0;
+   }
+   fwrite(q, 1, (size_t)(objEnd + 6 - q), out);
+   fputc('\n', out);
+   return 1;
+}
+
+static int pdfMerge(const char *outPath, PdfFile *parts, int count)
+{
+   // Objects of part i are renumbered by the sum of the /Size of parts before
+   // it; each part's page tree is hung below a new root Pages object.
+   int *base = (int *)malloc((size_t)(count + 1) * sizeof(int));
+   if(!base)
+   {
+      fatal("Out of memory merging PDF files");
+   }
+   base[0] = 0;
+   for(int i = 0; i < count; i++)
+   {
+      base[i + 1] = base[i] + parts[i].objCount;
+   }
+   int rootPages = base[count];
+   int catalog = rootPages + 1;
+   int size = catalog + 1;
+
+   long long *offsets = (long long *)malloc((size_t)size * sizeof(long long));
+   int *gens = (int *)calloc((size_t)size, sizeof(int));
+   if(!offsets || !gens)
+   {
+      fatal("Out of memory merging PDF files");
+   }
+   for(int i = 0; i < size; i++)
+   {
+      offsets[i] = -1;
+   }
+
+   FILE *out = fopen(outPath, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", outPath, strerror(errno));
+      free(base);
+      free(offsets);
+      free(gens);
+      return 0;
+   }
+
+   const char *header = parts[0].data;
+   const char *eol = strpbrk(header, "\r\n");
+   if(strncmp(header, "%PDF-", 5) == 0 && eol && eol - header < 16)
+   {
+      fwrite(header, 1, (size_t)(eol - header), out);
+      fputs("\n%\xE2\xE3\xCF\xD3\n", out);
+   }
+   else
+   {
+      fputs("%PDF-1.5\n%\xE2\xE3\xCF\xD3\n", out);
+   }
+
+   int pageCount = 0;
+   int ok = 1;
+   for(int i = 0; i < count && ok; i++)
+   {
+      for(int n = 1; n < parts[i].objCount; n++)
+      {
+         if(parts[i].offsets[n] < 0)
+         {
+            continue;
+         }
+         offsets[base[i] + n] = (long long)ftello(out);
+         gens[base[i] + n] = parts[i].gens[n];
+         if(!pdfCopyObject(out, &parts[i], n, base[i], (n == parts[i].rootPages) ? rootPages : 0))
+         {
+            fprintf(stderr, "Error: could not copy PDF object %d of shard %d\n", n, i);
+            ok = 0;
+            break;
+         }
+      }
+      pageCount += parts[i].pageCount;
+   }
+
+   offsets[rootPages] = (long long)ftello(out);
+   fprintf(out, "%d 0 obj\n<< /Type /Pages /Kids [", rootPages);
+   for(int i = 0; i < count; i++)
+   {
+      fprintf(out, " %d 0 R", base[i] + parts[i].rootPages);
+   }
+   fprintf(out, " ] /Count %d >>\nendobj\n", pageCount);
+
+   offsets[catalog] = (long long)ftello(out);
+   fprintf(out, "%d 0 obj\n<< /Type /Catalog /Pages %d 0 R >>\nendobj\n", catalog, rootPages);
+
+   long long xrefOff = (long long)ftello(out);
+   fprintf(out, "xref\n0 %d\n", size);
+   fputs("0000000000 65535 f \n", out);
+   for(int i = 1; i < size; i++)
+   {
+      if(offsets[i] >= 0)
+      {
+         fprintf(out, "%010lld %05d n \n", offsets[i], gens[i]);
+      }
+      else
+      {
+         fputs("0000000000 00000 f \n", out);
+      }
+   }
+   fprintf(out, "trailer\n<< /Size %d /Root %d 0 R", size, catalog);
+   if(parts[0].info > 0 && parts[0].info < parts[0].objCount && parts[0].offsets[parts[0].info] >= 0)
+   {
+      // Title, producer and dates of the first shard stand for the document
+      fprintf(out, " /Info %d %d R", base[0] + parts[0].info, parts[0].gens[parts[0].info]);
+   }
+   fprintf(out, " >>\nstartxref\n%lld\n%%%%EOF\n", xrefOff);
+
+   if(fclose(out) != 0)
+   {
+      ok = 0;
+   }
+   free(base);
+   free(offsets);
+   free(gens);
+   return ok;
+}
+
+typedef struct
+{
+   long long preambleEnd;   // Offset of "\begin{document}"
+   long long bodyStart;     // First byte after "\begin{document}"
+   long long bodyEnd;       // Offset of the closing "\end{document}"
+   MessageMarkList *marks;
+   AttachmentMarkList *attachments;   // Attachment blocks, for --bisect
+} TexLayout;
+
+static void runLatexJobs(const char *engine, char **texPaths, int count, const char *outDir, int jobs, int *status)
+{
+   // Runs up to `jobs` engine processes at a time; status[i] is 0 on success
+   pid_t *pids = (pid_t *)calloc((size_t)count, sizeof(pid_t));
+   long long *started = (long long *)calloc((size_t)count, sizeof(long long));
+   int *slot = (int *)calloc((size_t)count, sizeof(int));
+   char *slotBusy = (char *)calloc((size_t)jobs + 1, 1);
+   if(!pids || !started || !slot || !slotBusy)
+   {
+      fatal("Out of memory starting LaTeX jobs");
+   }
+   for(int i = 0; i < count; i++)
+   {
+      status[i] = 1;   // Until the job is reaped
+   }
+
+   char outDirArg[MaxPathLen + 32];
+   snprintf(outDirArg, sizeof(outDirArg), "-output-directory=%s", outDir);
+
+   int next = 0;
+   int running = 0;
+   while(next < count || running > 0)
+   {
+      while(running < jobs && next < count)
+      {
+         pid_t pid = fork();
+         if(pid < 0)
+         {
+            fatal("could not fork LaTeX process");
+         }
+         if(pid == 0)
+         {
+            int devNull = open("/dev/null", O_WRONLY);
+            if(devNull >= 0)
+            {
+               dup2(devNull, STDOUT_FILENO);
+               close(devNull);
+            }
+            execlp(engine, engine, "-interaction=batchmode", "-halt-on-error", outDirArg, texPaths[next], (char *)NULL);
+            _exit(127);
+         }
+         started[next] = traceBegin();
+         while(slotBusy[slot[next]])
+         {
+            slot[next]++;
+         }
+         slotBusy[slot[next]] = 1;
+         pids[next++] = pid;
+         running++;
+      }
+
+      int st;
+      pid_t done = wait(&st);
+      if(done < 0)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         break;
+      }
+      for(int i = 0; i < next; i++)
+      {
+         if(pids[i] == done)
+         {
+            status[i] = (WIFEXITED(st) && WEXITSTATUS(st) == 0) ? 0 : 1;
+            if(WIFEXITED(st) && WEXITSTATUS(st) == 127)
+            {
+               fprintf(stderr, "Error: could not run %s for '%s'\n", engine, texPaths[i]);
+               status[i] = 127;
+            }
+            // Jobs are drawn on one track per concurrent slot
+            traceEndLane("compile", engine, started[i], i, TraceJobLanes + slot[i]);
+            slotBusy[slot[i]] = 0;
+            pids[i] = 0;
+            running--;
+            break;
+         }
+      }
+   }
+
+   free(started);
+   free(pids);
+   free(slot);
+   free(slotBusy);
+}
+
+static int writeShardTex(const char *shardPath, int engine, FILE *tex, const char *preamble, size_t preambleLen, long long start, long long end, int firstPage)
+{
+   FILE *out = fopen(shardPath, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", shardPath, strerror(errno));
+      return 0;
+   }
+
+   fwrite(preamble, 1, preambleLen, out);
+   // Shards are merged by pdfMerge, which needs a classic xref table
+   if(engine == EnginePdfLatex)
+   {
+      fputs("\\pdfobjcompresslevel=0\n", out);
+   }
+   else
+   {
+      fputs("\\pdfvariable objcompresslevel=0\n", out);
+   }
+   fputs("\\begin{document}\n", out);
+   fprintf(out, "\\setcounter{page}{%d}\n\n", firstPage);
+
+   char buf[65536];
+   long long remaining = end - start;
+   fseeko(tex, (off_t)start, SEEK_SET);
+   while(remaining > 0)
+   {
+      size_t want = (remaining < (long long)sizeof(buf)) ? (size_t)remaining : sizeof(buf);
+      size_t got = fread(buf, 1, want, tex);
+      if(got == 0)
+      {
+         break;
+      }
+      fwrite(buf, 1, got, out);
+      remaining -= (long long)got;
+   }
+
+   fputs("\n\\end{document}\n", out);
+   return fclose(out) == 0 && remaining == 0;
+}
+
+static int compileParallel(const char *texPath, const TexLayout *layout, const DocumentOptions *doc, int jobs)
+{
+   // Splits the body into shards of roughly equal estimated page count, compiles
+   // them concurrently and merges the shard PDFs. Shards start on a fresh page;
+   // page numbers continue across shards.
+   char base[MaxPathLen];
+   snprintf(base, sizeof(base), "%s", texPath);
+   char *ext = strrchr(base, '.');
+   if(ext && strcmp(ext, ".tex") == 0)
+   {
+      *ext = '\0';
+   }
+
+   const char *engine = engineCommands[doc->engine];
+   char shardDir[MaxPathLen + 16];
+   snprintf(shardDir, sizeof(shardDir), "%s-shards", base);
+   if(mkdir(shardDir, 0777) != 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "Error: could not create '%s': %s\n", shardDir, strerror(errno));
+      return 0;
+   }
+
+   FILE *tex = fopen(texPath, "rb");
+   if(!tex)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", texPath, strerror(errno));
+      return 0;
+   }
+
+   size_t preambleLen = (size_t)layout->preambleEnd;
+   char *preamble = (char *)malloc(preambleLen + 1);
+   if(!preamble)
+   {
+      fatal("Out of memory reading preamble");
+   }
+   if(fread(preamble, 1, preambleLen, tex) != preambleLen)
+   {
+      fprintf(stderr, "Error: could not read preamble of '%s'\n", texPath);
+      free(preamble);
+      fclose(tex);
+      return 0;
+   }
+
+   // Cut at message boundaries once the running estimate passes k * total / shards
+   const MessageMarkList *marks = layout->marks;
+   double total = 0.0;
+   for(size_t i = 0; i < marks->count; i++)
+   {
+      total += marks->items[i].pages;
+   }
+
+   int shardCount = jobs;
+   if((size_t)shardCount > marks->count)
+   {
+      shardCount = (int)marks->count;
+   }
+   if(shardCount < 1)
+   {
+      shardCount = 1;
+   }
+
+   long long *starts = (long long *)malloc((size_t)(shardCount + 1) * sizeof(long long));
+   int *firstPage = (int *)malloc((size_t)shardCount * sizeof(int));
+   int *pages = (int *)calloc((size_t)shardCount, sizeof(int));
+   int *status = (int *)malloc((size_t)shardCount * sizeof(int));
+   char **texPaths = (char **)calloc((size_t)shardCount, sizeof(char *));
+   char **pdfPaths = (char **)calloc((size_t)shardCount, sizeof(char *));
+   PdfFile *pdfs = (PdfFile *)calloc((size_t)shardCount, sizeof(PdfFile));
+   if(!starts || !firstPage || !pages || !status || !texPaths || !pdfPaths || !pdfs)
+   {
+      fatal("Out of memory planning shards");
+   }
+
+   double target = total / shardCount;
+   double acc = 0.0;
+   double shardEst = 0.0;
+   int k = 1;
+   starts[0] = layout->bodyStart;
+   for(size_t i = 0; i < marks->count; i++)
+   {
+      if(k < shardCount && acc >= k * target && marks->items[i].outOffset > starts[k - 1])
+      {
+         pages[k - 1] = (int)shardEst + 1;
+         shardEst = 0.0;
+         starts[k++] = marks->items[i].outOffset;
+      }
+      acc += marks->items[i].pages;
+      shardEst += marks->items[i].pages;
+   }
+   pages[k - 1] = (int)shardEst + 1;
+   shardCount = k;
+   starts[shardCount] = layout->bodyEnd;
+
+   int ok = 1;
+   int next = 1;
+   size_t shardPathLen = strlen(shardDir) + 32;   // "/shard-NNN.tex" for any int
+   for(int i = 0; i < shardCount; i++)
+   {
+      texPaths[i] = (char *)malloc(shardPathLen);
+      pdfPaths[i] = (char *)malloc(shardPathLen);
+      if(!texPaths[i] || !pdfPaths[i])
+      {
+         fatal("Out of memory planning shards");
+      }
+      snprintf(texPaths[i], shardPathLen, "%s/shard-%03d.tex", shardDir, i);
+      snprintf(pdfPaths[i], shardPathLen, "%s/shard-%03d.pdf", shardDir, i);
+      firstPage[i] = next;
+      next += pages[i];
+      ok = ok && writeShardTex(texPaths[i], doc->engine, tex, preamble, preambleLen, starts[i], starts[i + 1], firstPage[i]);
+   }
+
+   fprintf(stderr, "Compiling %d shards (~%d pages) with %d jobs\n", shardCount, next - 1, jobs);
+
+   // Compile all shards, then recompile those whose estimated first page was
+   // off. A shard's page count does not depend on its first page number, so a
+   // single correction round suffices.
+   char **pending = (char **)malloc((size_t)shardCount * sizeof(char *));
+   int *pendingIdx = (int *)malloc((size_t)shardCount * sizeof(int));
+   if(!pending || !pendingIdx)
+   {
+      fatal("Out of memory planning shards");
+   }
+   for(int round = 0; round < 2 && ok; round++)
+   {
+      int pendingCount = 0;
+      next = 1;
+      for(int i = 0; i < shardCount; i++)
+      {
+         if(round == 0 || firstPage[i] != next)
+         {
+            if(round > 0)
+            {
+               firstPage[i] = next;
+               pdfFree(&pdfs[i]);
+               ok = ok && writeShardTex(texPaths[i], doc->engine, tex, preamble, preambleLen, starts[i], starts[i + 1], firstPage[i]);
+            }
+            pendingIdx[pendingCount] = i;
+            pending[pendingCount++] = texPaths[i];
+         }
+         next += pages[i];
+      }
+      if(pendingCount == 0)
+      {
+         break;
+      }
+
+      runLatexJobs(engine, pending, pendingCount, shardDir, jobs, status);
+      for(int j = 0; j < pendingCount && ok; j++)
+      {
+         int i = pendingIdx[j];
+         if(status[j] != 0)
+         {
+            fprintf(stderr, "Error: %s failed on '%s' (see %s/shard-%03d.log)\n", engine, texPaths[i], shardDir, i);
+            ok = 0;
+         }
+         else if(!pdfLoad(pdfPaths[i], &pdfs[i]))
+         {
+            ok = 0;
+         }
+         else
+         {
+            pages[i] = pdfs[i].pageCount;
+         }
+      }
+   }
+
+   char pdfPath[MaxPathLen + 8];
+   snprintf(pdfPath, sizeof(pdfPath), "%s.pdf", base);
+   long long mergeStart = traceBegin();
+   ok = ok && pdfMerge(pdfPath, pdfs, shardCount);
+   traceEnd("compile", "pdf merge", mergeStart, shardCount);
+   if(ok)
+   {
+      int total = 0;
+      for(int i = 0; i < shardCount; i++)
+      {
+         total += pdfs[i].pageCount;
+      }
+      fprintf(stderr, "Wrote %s (%d pages from %d shards)\n", pdfPath, total, shardCount);
+   }
+   else
+   {
+      ok = 0;
+   }
+
+   for(int i = 0; i < shardCount; i++)
+   {
+      pdfFree(&pdfs[i]);
+      free(texPaths[i]);
+      free(pdfPaths[i]);
+   }
+   free(pdfs);
+   free(texPaths);
+   free(pdfPaths);
+   free(pending);
+   free(pendingIdx);
+   free(status);
+   free(pages);
+   free(firstPage);
+   free(starts);
+   free(preamble);
+   fclose(tex);
+   return ok;
+}
+
+// Compile failure bisection (--bisect). Message-aligned ranges of the body are
+// compiled on their own, up to --jobs at a time, keeping the first failing range
+// each round until a single message is left; the attachment blocks of that
+// message are then compiled separately. Results are memoized by a hash of the
+// preamble, the range content and the path, size and modification time of each
+// image the range includes in "<name>-bisect/memo", so a rerun after a fix only
+// compiles ranges whose content or images changed.
+typedef struct
+{
+   FILE *tex;
+   int engine;
+   char dir[MaxPathLen + 16];
+   char *preamble;
+   size_t preambleLen;
+   uint64_t preambleHash;
+   const AttachmentMarkList *attachments;   // Images included by each range
+   StrMap memo;         // Content hash (hex) -> engine exit status
+   FILE *memoOut;
+   int jobs;
+   long long compiled;
+   long long reused;
+} Bisector;
+
+typedef char BisectName[17];
+
+static uint64_t bisectHash(Bisector *b, long long start, long long end)
+{
+   char buf[65536];
+   uint64_t h = b->preambleHash;
+   long long remaining = end - start;
+   fseeko(b->tex, (off_t)start, SEEK_SET);
+   while(remaining > 0)
+   {
+      size_t want = (remaining < (long long)sizeof(buf)) ? (size_t)remaining : sizeof(buf);
+      size_t got = fread(buf, 1, want, b->tex);
+      if(got == 0)
+      {
+         break;
+      }
+      h = hashBytesFrom(h, buf, got);
+      remaining -= (long long)got;
+   }
+
+   // The marks are in output order: find the first block in the range
+   const AttachmentMarkList *atts = b->attachments;
+   size_t lo = 0;
+   size_t hi = atts ? atts->count : 0;
+   while(lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      if(atts->items[mid].outStart < start)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   for(size_t i = lo; atts && i < atts->count && atts->items[i].outStart < end; i++)
+   {
+      const char *file = atts->items[i].file;
+      if(!file)
+      {
+         continue;
+      }
+      struct stat st;
+      long long meta[3] = { -1, -1, -1 };
+      if(stat(file, &st) == 0)
+      {
+         meta[0] = (long long)st.st_size;
+         meta[1] = (long long)st.st_mtim.tv_sec;
+         meta[2] = (long long)st.st_mtim.tv_nsec;
+      }
+      h = hashBytesFrom(h, file, strlen(file) + 1);
+      h = hashBytesFrom(h, meta, sizeof(meta));
+   }
+   return h;
+}
+
+static int bisectRun(Bisector *b, int count, const long long *starts, const long long *ends, int *failed, BisectName *names)
+{
+   // Compiles the ranges not yet in the memo; failed[i] is set for ranges that
+   // do not compile. Returns 0 if the engine could not be run.
+   char **pending = (char **)calloc((size_t)count, sizeof(char *));
+   int *pendingIdx = (int *)malloc((size_t)count * sizeof(int));
+   int *status = (int *)malloc((size_t)count * sizeof(int));
+   if(!pending || !pendingIdx || !status)
+   {
+      fatal("Out of memory planning bisection");
+   }
+
+   int ok = 1;
+   int pendingCount = 0;
+   for(int i = 0; i < count && ok; i++)
+   {
+      snprintf(names[i], sizeof(names[i]), "%016llx", (unsigned long long)bisectHash(b, starts[i], ends[i]));
+      long long *memo = strMapFind(&b->memo, names[i]);
+      if(memo)
+      {
+         failed[i] = (*memo != 0);
+         b->reused++;
+         continue;
+      }
+
+      char *path = (char *)malloc(MaxPathLen + 48);
+      if(!path)
+      {
+         fatal("Out of memory planning bisection");
+      }
+      snprintf(path, MaxPathLen + 48, "%s/%s.tex", b->dir, names[i]);
+      ok = writeShardTex(path, b->engine, b->tex, b->preamble, b->preambleLen, starts[i], ends[i], 1);
+      pendingIdx[pendingCount] = i;
+      pending[pendingCount++] = path;
+   }
+
+   if(ok && pendingCount > 0)
+   {
+      runLatexJobs(engineCommands[b->engine], pending, pendingCount, b->dir, b->jobs, status);
+      for(int j = 0; j < pendingCount; j++)
+      {
+         int i = pendingIdx[j];
+         if(status[j] == 127)
+         {
+            ok = 0;
+            continue;
+         }
+         failed[i] = (status[j] != 0);
+         strMapInsert(&b->memo, names[i], status[j]);
+         fprintf(b->memoOut, "%s\t%d\n", names[i], status[j]);
+         b->compiled++;
+      }
+      fflush(b->memoOut);
+   }
+
+   for(int j = 0; j < pendingCount; j++)
+   {
+      free(pending[j]);
+   }
+   free(pending);
+   free(pendingIdx);
+   free(status);
+   return ok;
+}
+
+static void bisectPrintLines(const MessageMarkList *marks, size_t lo, size_t hi)
+{
+   // Input line range of messages [lo, hi)
+   if(hi < marks->count)
+   {
+      fprintf(stderr, "input lines %lld-%lld", marks->items[lo].inputLine, marks->items[hi].inputLine - 1);
+   }
+   else
+   {
+      fprintf(stderr, "input lines %lld-end", marks->items[lo].inputLine);
+   }
+}
+
+static int bisectCompile(const char *texPath, const TexLayout *layout, const DocumentOptions *doc, int jobs)
+{
+   // Returns 1 if the document compiles, 0 after reporting what breaks it
+   char base[MaxPathLen];
+   snprintf(base, sizeof(base), "%s", texPath);
+   char *ext = strrchr(base, '.');
+   if(ext && strcmp(ext, ".tex") == 0)
+   {
+      *ext = '\0';
+   }
+
+   Bisector b;
+   memset(&b, 0, sizeof(b));
+   b.engine = doc->engine;
+   b.jobs = jobs;
+   b.attachments = layout->attachments;
+   snprintf(b.dir, sizeof(b.dir), "%s-bisect", base);
+   if(mkdir(b.dir, 0777) != 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "Error: could not create '%s': %s\n", b.dir, strerror(errno));
+      return 0;
+   }
+
+   b.tex = fopen(texPath, "rb");
+   if(!b.tex)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", texPath, strerror(errno));
+      return 0;
+   }
+   b.preambleLen = (size_t)layout->preambleEnd;
+   b.preamble = (char *)malloc(b.preambleLen + 1);
+   if(!b.preamble)
+   {
+      fatal("Out of memory reading preamble");
+   }
+   if(fread(b.preamble, 1, b.preambleLen, b.tex) != b.preambleLen)
+   {
+      fprintf(stderr, "Error: could not read preamble of '%s'\n", texPath);
+      free(b.preamble);
+      fclose(b.tex);
+      return 0;
+   }
+   b.preambleHash = hashBytesFrom(hashBytes(&b.engine, sizeof(b.engine)), b.preamble, b.preambleLen);
+
+   char memoPath[MaxPathLen + 32];
+   snprintf(memoPath, sizeof(memoPath), "%s/memo", b.dir);
+   strMapInit(&b.memo);
+   char *memoData;
+   size_t memoSize;
+   if(readWholeFile(memoPath, &memoData, &memoSize))
+   {
+      char *line = memoData;
+      while(*line)
+      {
+         char *next = strchr(line, '\n');
+         if(next)
+         {
+            *next++ = '\0';
+         }
+         else
+         {
+            next = line + strlen(line);
+         }
+         char *cursor = line;
+         char *name = splitField(&cursor);
+         if(strlen(name) == 16 && *cursor != '\0')
+         {
+            *strMapInsert(&b.memo, name, 0) = atoi(cursor);
+         }
+         line = next;
+      }
+      free(memoData);
+   }
+   b.memoOut = fopen(memoPath, "ab");
+   if(!b.memoOut)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", memoPath, strerror(errno));
+      strMapFree(&b.memo);
+      free(b.preamble);
+      fclose(b.tex);
+      return 0;
+   }
+
+   // Message i spans [marks[i].outOffset, marks[i + 1].outOffset)
+   const MessageMarkList *marks = layout->marks;
+   size_t messageCount = marks->count;
+   int width = (jobs > 1) ? jobs : 2;
+   size_t cap = (size_t)width;
+   if(layout->attachments && layout->attachments->count > cap)
+   {
+      cap = layout->attachments->count;
+   }
+   long long *starts = (long long *)malloc(cap * sizeof(long long));
+   long long *ends = (long long *)malloc(cap * sizeof(long long));
+   size_t *firstMessage = (size_t *)malloc((cap + 1) * sizeof(size_t));
+   int *failed = (int *)calloc(cap, sizeof(int));
+   BisectName *names = (BisectName *)malloc(cap * sizeof(BisectName));
+   if(!starts || !ends || !firstMessage || !failed || !names)
+   {
+      fatal("Out of memory planning bisection");
+   }
+
+   // Round 0 compiles the whole body; later rounds split the failing range
+   size_t lo = 0;
+   size_t hi = messageCount;
+   int ok = 1;
+   int broken = 0;
+   int combined = 0;
+   for(int round = 0; ok && (round == 0 || hi - lo > 1); round++)
+   {
+      int parts = 1;
+      if(round > 0)
+      {
+         parts = (hi - lo < (size_t)width) ? (int)(hi - lo) : width;
+      }
+      for(int p = 0; p <= parts; p++)
+      {
+         firstMessage[p] = lo + (hi - lo) * (size_t)p / (size_t)parts;
+      }
+      for(int p = 0; p < parts; p++)
+      {
+         starts[p] = (messageCount > 0) ? marks->items[firstMessage[p]].outOffset : layout->bodyStart;
+         ends[p] = (firstMessage[p + 1] < messageCount) ? marks->items[firstMessage[p + 1]].outOffset : layout->bodyEnd;
+         failed[p] = 0;
+      }
+
+      long long roundStart = traceBegin();
+      ok = bisectRun(&b, parts, starts, ends, failed, names);
+      traceEnd("bisect", "round", roundStart, parts);
+
+      int first = -1;
+      for(int p = 0; p < parts && first < 0; p++)
+      {
+         if(failed[p])
+         {
+            first = p;
+         }
+      }
+      if(!ok)
+      {
+         break;
+      }
+      if(round == 0)
+      {
+         broken = (first == 0);
+         if(!broken || messageCount == 0)
+         {
+            break;
+         }
+         fprintf(stderr, "%s fails; bisecting %zu messages with %d jobs\n", texPath, messageCount, jobs);
+         continue;
+      }
+      if(first < 0)
+      {
+         combined = 1;
+         break;
+      }
+      lo = firstMessage[first];
+      hi = firstMessage[first + 1];
+      fprintf(stderr, "Round %d: %d ranges, first failure in ", round, parts);
+      bisectPrintLines(marks, lo, hi);
+      fputc('\n', stderr);
+   }
+
+   if(ok && !broken)
+   {
+      fprintf(stderr, "%s compiles without errors\n", texPath);
+   }
+   else if(ok && messageCount == 0)
+   {
+      fprintf(stderr, "%s fails; see %s/%s.log\n", texPath, b.dir, names[0]);
+   }
+   else if(ok)
+   {
+      long long msgStart = marks->items[lo].outOffset;
+      long long msgEnd = (hi < messageCount) ? marks->items[hi].outOffset : layout->bodyEnd;
+      BisectName rangeName;
+      snprintf(rangeName, sizeof(rangeName), "%016llx", (unsigned long long)bisectHash(&b, msgStart, msgEnd));
+      if(combined)
+      {
+         // Every part compiles alone: the failure needs several messages
+         fprintf(stderr, "The messages in ");
+         bisectPrintLines(marks, lo, hi);
+         fprintf(stderr, " fail only together; see %s/%s.log\n", b.dir, rangeName);
+      }
+      else
+      {
+         fprintf(stderr, "First failing message starts at input line %lld; see %s/%s.log\n", marks->items[lo].inputLine, b.dir, rangeName);
+      }
+
+      // Compile the message's attachment blocks on their own
+      const AttachmentMarkList *atts = layout->attachments;
+      int count = 0;
+      size_t firstAtt = 0;
+      for(size_t i = 0; atts && i < atts->count; i++)
+      {
+         if(atts->items[i].outStart >= msgStart && atts->items[i].outStart < msgEnd)
+         {
+            if(count == 0)
+            {
+               firstAtt = i;
+            }
+            starts[count] = atts->items[i].outStart;
+            ends[count] = atts->items[i].outEnd;
+            failed[count] = 0;
+            count++;
+         }
+      }
+      if(count > 0 && !combined)
+      {
+         ok = bisectRun(&b, count, starts, ends, failed, names);
+         int culprits = 0;
+         for(int k = 0; ok && k < count; k++)
+         {
+            if(failed[k])
+            {
+               const AttachmentMark *m = &atts->items[firstAtt + (size_t)k];
+               fprintf(stderr, "Attachment '%s' (input line %lld) fails on its own; see %s/%s.log\n", m->label, m->inputLine, b.dir, names[k]);
+               culprits++;
+            }
+         }
+         if(ok && culprits == 0)
+         {
+            fprintf(stderr, "The attachments of this message compile on their own; the problem is in its text\n");
+         }
+      }
+   }
+   if(ok)
+   {
+      fprintf(stderr, "Bisection compiled %lld ranges, %lld results reused from %s\n", b.compiled, b.reused, memoPath);
+   }
+
+   free(starts);
+   free(ends);
+   free(firstMessage);
+   free(failed);
+   free(names);
+   fclose(b.memoOut);
+   strMapFree(&b.memo);
+   free(b.preamble);
+   fclose(b.tex);
+   return ok && !broken;
+}
+
+static void replaceExtension(const char *path, const char *ext, char *out, size_t outCap)
+{
+   // "dir/messages.txt" + ".tex" -> "dir/messages.tex"
+   const char *lastDot = strrchr(path, '.');
+   size_t baseLen = (lastDot && lastDot != path) ? (size_t)(lastDot - path) : strlen(path);
+   if(baseLen + strlen(ext) >= outCap)
+   {
+      baseLen = outCap - strlen(ext) - 1;
+   }
+   memcpy(out, path, baseLen);
+   snprintf(out + baseLen, outCap - baseLen, "%s", ext);
+}
+
+typedef struct
+{
+   char inputPath[MaxPathLen];
+   char attachmentsDir[MaxPathLen];
+   int shardCount;
+   // Shard selected by planLoad
+   long long start;
+   long long end;
+   char **attachments;   // Resolved file name per reference, "" if unmatched
+   size_t attachmentCount;
+   size_t attachmentCap;
+} ShardPlan;
+
+static void shardPlanAddAttachment(ShardPlan *plan, const char *name)
+{
+   if(plan->attachmentCount >= plan->attachmentCap)
+   {
+      size_t newCap = (plan->attachmentCap == 0) ? 64 : (plan->attachmentCap * 2);
+      char **newItems = (char **)realloc(plan->attachments, newCap * sizeof(char *));
+      if(!newItems)
+      {
+         fatal("Out of memory reallocating shard attachment list");
+      }
+      plan->attachments = newItems;
+      plan->attachmentCap = newCap;
+   }
+   plan->attachments[plan->attachmentCount] = strdup(name);
+   if(!plan->attachments[plan->attachmentCount])
+   {
+      fatal("Out of memory copying attachment name");
+   }
+   plan->attachmentCount++;
+}
+
+static void shardPlanClearAttachments(ShardPlan *plan)
+{
+   for(size_t i = 0; i < plan->attachmentCount; i++)
+   {
+      free(plan->attachments[i]);
+   }
+   plan->attachmentCount = 0;
+}
+
+static void shardPlanFree(ShardPlan *plan)
+{
+   shardPlanClearAttachments(plan);
+   free(plan->attachments);
+   plan->attachments = NULL;
+   plan->attachmentCap = 0;
+}
+
+static int planFieldOk(const char *field, const char *what)
+{
+   // Manifest fields are tab-separated lines, so they cannot hold tabs or line breaks
+   if(strpbrk(field, "\t\r\n"))
+   {
+      fprintf(stderr, "Error: %s '%s' contains a tab or line break and cannot be planned\n", what, field);
+      return 0;
+   }
+   return 1;
+}
+
+static void writeShardBlock(FILE *manifest, int index, long long start, long long end, long long firstMessage, const char *sent, const ShardPlan *plan)
+{
+   fprintf(manifest, "shard\t%d\t%lld\t%lld\t%lld\t%s\n", index, start, end, firstMessage, sent);
+   for(size_t i = 0; i < plan->attachmentCount; i++)
+   {
+      fprintf(manifest, "att\t%s\n", plan->attachments[i]);
+   }
+}
+
+static int runPlan(const char *inputPath, const char *attachmentsDir, int shardCount, const SizeTolerance *tolerance)
+{
+   // Scans the export once and writes "<name>.plan": message-aligned byte
+   // ranges, each with its first message number, timestamp and the files its
+   // attachment references resolve to. Resolution happens here, against the
+   // whole directory, so workers reproduce the matching of a single run.
+   FILE *in = fopen(inputPath, "rb");
+   if(!in)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", inputPath, strerror(errno));
+      return 0;
+   }
+   struct stat st;
+   if(fstat(fileno(in), &st) != 0)
+   {
+      fprintf(stderr, "Error: could not stat '%s': %s\n", inputPath, strerror(errno));
+      fclose(in);
+      return 0;
+   }
+   if(!planFieldOk(inputPath, "input path") || !planFieldOk(attachmentsDir, "attachments directory"))
+   {
+      fclose(in);
+      return 0;
+   }
+
+   char planPath[MaxPathLen];
+   replaceExtension(inputPath, ".plan", planPath, sizeof(planPath));
+   FILE *manifest = fopen(planPath, "wb");
+   if(!manifest)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", planPath, strerror(errno));
+      fclose(in);
+      return 0;
+   }
+
+   AttachmentList list;
+   attachmentListInit(&list);
+   loadAttachments(attachmentsDir, &list, tolerance ? inputPath : NULL, 0);
+
+   fputs("txt2tex-plan\t1\n", manifest);
+   fprintf(manifest, "input\t%s\n", inputPath);
+   fprintf(manifest, "attachments\t%s\n", attachmentsDir);
+
+   ShardPlan plan;
+   memset(&plan, 0, sizeof(plan));
+
+   double target = (double)st.st_size / shardCount;
+   long long pos = 0;
+   long long shardStart = 0;
+   long long shardFirstMessage = 1;
+   long long messages = 0;
+   char shardSent[256] = "";
+   long long msgSent = -1;
+   int index = 0;
+   int inHeader = 0;
+
+   long long chunkStart = traceBegin();
+   long long chunkLines = 0;
+
+   int ok = 1;
+   char line[8192];
+   while(ok && fgets(line, (int)sizeof(line), in))
+   {
+      long long lineStart = pos;
+      pos += (long long)strlen(line);
+      trimRight(line);
+
+      if(++chunkLines == 4096)
+      {
+         traceEnd("plan", "chunk", chunkStart, chunkLines);
+         chunkStart = traceBegin();
+         chunkLines = 0;
+      }
+
+      int kind = classifyLine(line);
+      int isHeader = (lineRules[kind].flags & LineHeader) != 0;
+      if((lineRules[kind].flags & LineStart) && !inHeader)
+      {
+         messages++;
+         if(index + 1 < shardCount && lineStart > shardStart && lineStart >= (index + 1) * target)
+         {
+            writeShardBlock(manifest, index++, shardStart, lineStart, shardFirstMessage, shardSent, &plan);
+            shardPlanClearAttachments(&plan);
+            shardStart = lineStart;
+            shardFirstMessage = messages;
+            shardSent[0] = '\0';
+         }
+      }
+      inHeader = isHeader;
+
+      if(kind == LineSent && tolerance)
+      {
+         msgSent = parseSentTime(line, NULL);
+      }
+      if(shardSent[0] == '\0' && kind == LineSent)
+      {
+         const char *v = line + strlen("Sent:");
+         while(*v && isspace((unsigned char)*v))
+         {
+            v++;
+         }
+         size_t n = strnlen(v, sizeof(shardSent) - 1);   // Informational, may be cut
+         memcpy(shardSent, v, n);
+         shardSent[n] = '\0';
+      }
+
+      if(kind == LineAttachment)
+      {
+         char attMime[128];
+         long long sizeDiff;
+         int idx = matchAttachment(&list, line, tolerance, msgSent, attMime, sizeof(attMime), &sizeDiff);
+         if(idx >= 0)
+         {
+            list.items[idx].used = 1;
+            ok = planFieldOk(list.items[idx].fileName, "attachment");
+         }
+         shardPlanAddAttachment(&plan, (idx >= 0) ? list.items[idx].fileName : "");
+      }
+   }
+   writeShardBlock(manifest, index++, shardStart, pos, shardFirstMessage, shardSent, &plan);
+   traceEnd("plan", "chunk", chunkStart, chunkLines);
+
+   ok = !ferror(in) && ok;
+   ok = (fclose(manifest) == 0) && ok;
+   fclose(in);
+   shardPlanFree(&plan);
+   attachmentListFree(&list);
+
+   if(ok)
+   {
+      fprintf(stderr, "Wrote %s (%d shards, %lld messages)\n", planPath, index, messages);
+   }
+   else
+   {
+      remove(planPath);
+   }
+   return ok;
+}
+
+static int planLoad(const char *planPath, int shardIndex, ShardPlan *plan)
+{
+   // Reads the manifest header and, if shardIndex >= 0, that shard's range
+   // and attachment list
+   memset(plan, 0, sizeof(*plan));
+
+   FILE *f = fopen(planPath, "rb");
+   if(!f)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", planPath, strerror(errno));
+      return 0;
+   }
+
+   char line[MaxPathLen + 64];
+   if(!fgets(line, (int)sizeof(line), f) || strcmp(line, "txt2tex-plan\t1\n") != 0)
+   {
+      fprintf(stderr, "Error: '%s' is not a txt2tex plan\n", planPath);
+      fclose(f);
+      return 0;
+   }
+
+   int found = 0;
+   int current = -1;
+   while(fgets(line, (int)sizeof(line), f))
+   {
+      line[strcspn(line, "\r\n")] = '\0';
+      char *cursor = line;
+      char *key = splitField(&cursor);
+
+      if(strcmp(key, "input") == 0)
+      {
+         snprintf(plan->inputPath, sizeof(plan->inputPath), "%s", cursor);
+      }
+      else if(strcmp(key, "attachments") == 0)
+      {
+         snprintf(plan->attachmentsDir, sizeof(plan->attachmentsDir), "%s", cursor);
+      }
+      else if(strcmp(key, "shard") == 0)
+      {
+         current = atoi(splitField(&cursor));
+         plan->shardCount++;
+         if(current == shardIndex)
+         {
+            plan->start = strtoll(splitField(&cursor), NULL, 10);
+            plan->end = strtoll(splitField(&cursor), NULL, 10);
+            found = 1;
+         }
+      }
+      else if(strcmp(key, "att") == 0 && current == shardIndex && found)
+      {
+         shardPlanAddAttachment(plan, cursor);
+      }
+   }
+   fclose(f);
+
+   if(shardIndex >= 0 && !found)
+   {
+      fprintf(stderr, "Error: '%s' has no shard %d\n", planPath, shardIndex);
+      shardPlanFree(plan);
+      return 0;
+   }
+   return 1;
+}
+
+static int shardPartPath(const char *planPath, int index, char *out, size_t outCap)
+{
+   // Returns 0 if the path does not fit
+   char base[MaxPathLen];
+   replaceExtension(planPath, "", base, sizeof(base));
+   int n = snprintf(out, outCap, "%s.part-%03d.tex", base, index);
+   if(n < 0 || (size_t)n >= outCap)
+   {
+      fprintf(stderr, "Error: fragment path for '%s' is too long\n", planPath);
+      return 0;
+   }
+   return 1;
+}
+
+static int runWorker(const char *planPath, int shardIndex, const DocumentOptions *doc, Redactor *redactor)
+{
+   // Converts one shard of a plan into a body-only fragment. Only the files
+   // the shard references are looked up, so the worker needs just that subset
+   // of the attachments directory.
+   ShardPlan plan;
+   if(!planLoad(planPath, shardIndex, &plan))
+   {
+      return 0;
+   }
+
+   AttachmentList list;
+   attachmentListInit(&list);
+   for(size_t i = 0; i < plan.attachmentCount; i++)
+   {
+      if(plan.attachments[i][0] == '\0')
+      {
+         continue;
+      }
+
+      AttachmentFile f;
+      memset(&f, 0, sizeof(f));
+      snprintf(f.fileName, sizeof(f.fileName), "%s", plan.attachments[i]);
+      int n = snprintf(f.fullPath, sizeof(f.fullPath), "%s/%s", plan.attachmentsDir, plan.attachments[i]);
+
+      struct stat st;
+      if(n < 0 || (size_t)n >= sizeof(f.fullPath) || stat(f.fullPath, &st) != 0 || !S_ISREG(st.st_mode))
+      {
+         fprintf(stderr, "Error: shard %d needs attachment '%s'\n", shardIndex, f.fullPath);
+         attachmentListFree(&list);
+         shardPlanFree(&plan);
+         return 0;
+      }
+      f.fileSize = (long long)st.st_size;
+      f.mtime = (long long)st.st_mtime;
+      attachmentListPush(&list, &f);
+   }
+
+   FILE *in = fopen(plan.inputPath, "rb");
+   if(!in)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", plan.inputPath, strerror(errno));
+      attachmentListFree(&list);
+      shardPlanFree(&plan);
+      return 0;
+   }
+
+   char partPath[MaxPathLen + 32];
+   int pathOk = shardPartPath(planPath, shardIndex, partPath, sizeof(partPath));
+   FILE *out = pathOk ? fopen(partPath, "wb") : NULL;
+   if(!out)
+   {
+      if(pathOk)
+      {
+         fprintf(stderr, "Error: could not open '%s' for writing: %s\n", partPath, strerror(errno));
+      }
+      fclose(in);
+      attachmentListFree(&list);
+      shardPlanFree(&plan);
+      return 0;
+   }
+
+   Converter cv;
+   converterInit(&cv, out, doc, &list, NULL);
+   cv.planned = plan.attachments;
+   cv.plannedCount = plan.attachmentCount;
+   cv.redactor = redactor;
+   convertRange(&cv, in, plan.start, plan.end);
+
+   int ok = !ferror(in);
+   ok = (fclose(out) == 0) && ok;
+   fclose(in);
+   attachmentListFree(&list);
+   shardPlanFree(&plan);
+
+   if(ok)
+   {
+      fprintf(stderr, "Wrote %s\n", partPath);
+      printStats(&cv.stats, redactor);
+   }
+   return ok;
+}
+
+static int runStitch(const char *planPath, const DocumentOptions *doc)
+{
+   // Wraps the worker fragments of a plan, in order, into "<name>.tex"
+   ShardPlan plan;
+   if(!planLoad(planPath, -1, &plan))
+   {
+      return 0;
+   }
+
+   char outputPath[MaxPathLen];
+   replaceExtension(planPath, ".tex", outputPath, sizeof(outputPath));
+   FILE *out = fopen(outputPath, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", outputPath, strerror(errno));
+      return 0;
+   }
+
+   writePreamble(out, doc);
+   fputs("\\begin{document}\n\n", out);
+
+   int ok = 1;
+   char buf[65536];
+   for(int i = 0; i < plan.shardCount && ok; i++)
+   {
+      char partPath[MaxPathLen + 32];
+      if(!shardPartPath(planPath, i, partPath, sizeof(partPath)))
+      {
+         ok = 0;
+         break;
+      }
+      FILE *part = fopen(partPath, "rb");
+      if(!part)
+      {
+         fprintf(stderr, "Error: could not open '%s': %s\n", partPath, strerror(errno));
+         ok = 0;
+         break;
+      }
+      size_t got;
+      while((got = fread(buf, 1, sizeof(buf), part)) > 0)
+      {
+         fwrite(buf, 1, got, out);
+      }
+      ok = !ferror(part);
+      fclose(part);
+   }
+
+   fputs("\n\\end{document}\n", out);
+   ok = (fclose(out) == 0) && ok;
+
+   if(ok)
+   {
+      fprintf(stderr, "Wrote %s (%d shards)\n", outputPath, plan.shardCount);
+   }
+   return ok;
+}
+
+typedef struct
+{
+   const char *inputPath;
+   int compile;   // Run the parallel LaTeX driver after conversion
+   int bisect;    // Find the message that breaks compilation
+   int jobs;      // Concurrent LaTeX processes
+   int plan;      // Number of shards to plan, 0 if not planning
+   int worker;    // Shard to convert from a plan, -1 if not a worker
+   int stitch;    // Assemble worker fragments of a plan
+   const char *tracePath;   // Chrome trace-event output, NULL if not tracing
+   const char *redactTerms; // Term list for redaction, NULL if none
+   int redactScanners;      // Redact phone numbers, e-mail addresses and IBANs
+   int attachmentCache;     // Reuse and update "<name>.attcache"
+   int approximateSizes;    // Match attachment sizes within sizeTolerance
+   SizeTolerance sizeTolerance;
+   const char *analyticsPath;   // Conversation statistics output, NULL if none
+   int index;                   // Write the search index "<name>.idx"
+   int dedupQuotes;             // Replace quotes of emitted messages by references
+   long long tailCount;         // Convert only the last N messages, 0 for all
+   long long since;             // Convert only messages sent from this time on, -1 for all
+   long long startOffset;       // Input offset of the first message to convert
+   const char *query;           // Term or phrase to look up in the index, NULL if converting
+   OutputTarget targets[MaxTargets];   // --target outputs, replacing "<name>.tex"
+   int targetCount;
+   DocumentOptions doc;
+} Options;
+
+static void usage(const char *prog)
+{
+   fprintf(stderr, "Usage: %s [options] [--compile | --bisect] [--jobs N] <input_file>\n", prog);
+   fprintf(stderr, "       %s [--trace out.json] --plan N <input_file>\n", prog);
+   fprintf(stderr, "       %s [options] --worker K <plan_file>\n", prog);
+   fprintf(stderr, "       %s [options] --stitch <plan_file>\n", prog);
+   fprintf(stderr, "       %s [options] --target FORMAT:PATH[:images=DIR][:proof] ... <input_file>\n", prog);
+   fprintf(stderr, "       %s --query TEXT <input_file>\n", prog);
+   fprintf(stderr, "Options:\n");
+   fprintf(stderr, "  --trace out.json       Write a Chrome trace-event timeline\n");
+   fprintf(stderr, "  --engine NAME          Target lualatex (default) or pdflatex\n");
+   fprintf(stderr, "  --emoji-dir DIR        pdflatex: include emoji as PNG images from DIR\n");
+   fprintf(stderr, "  --proof                Replace images by frames of the same size\n");
+   fprintf(stderr, "  --redact               Redact phone numbers, e-mail addresses and IBANs\n");
+   fprintf(stderr, "  --redact-terms FILE    Redact the terms listed in FILE, one per line\n");
+   fprintf(stderr, "  --highlight            Highlight redaction matches instead of replacing them\n");
+   fprintf(stderr, "  --target SPEC          Write a tex or html output, up to %d targets\n", MaxTargets);
+   fprintf(stderr, "  --attachment-cache     Reuse attachment matches of the previous run\n");
+   fprintf(stderr, "  --size-tolerance N[%%]  Match attachment sizes up to N bytes (or N%%) off\n");
+   fprintf(stderr, "  --analytics FILE       Write conversation statistics as JSON (or CSV for .csv)\n");
+   fprintf(stderr, "  --index                Write a search index for --query\n");
+   fprintf(stderr, "  --dedup-quotes         Shorten quotes of earlier messages to a reference\n");
+   fprintf(stderr, "  --tail N               Convert only the last N messages\n");
+   fprintf(stderr, "  --since DATE           Convert only messages sent from DATE (YYYY-MM-DD, UTC) on\n");
+}
+
+static int parseTarget(char *spec, OutputTarget *t)
+{
+   // FORMAT:PATH[:images=DIR][:proof]; the fields are split in place
+   memset(t, 0, sizeof(*t));
+   char *field = strtok(spec, ":");
+   if(!field)
+   {
+      return 0;
+   }
+   if(strcmp(field, "tex") == 0)
+   {
+      t->format = TargetTex;
+   }
+   else if(strcmp(field, "html") == 0)
+   {
+      t->format = TargetHtml;
+   }
+   else
+   {
+      fprintf(stderr, "Error: unknown target format '%s'\n", field);
+      return 0;
+   }
+
+   t->path = strtok(NULL, ":");
+   if(!t->path)
+   {
+      fprintf(stderr, "Error: target needs an output path\n");
+      return 0;
+   }
+
+   while((field = strtok(NULL, ":")) != NULL)
+   {
+      if(strncmp(field, "images=", 7) == 0 && field[7] != '\0')
+      {
+         t->imagesDir = field + 7;
+      }
+      else if(strcmp(field, "proof") == 0)
+      {
+         t->proof = 1;
+      }
+      else
+      {
+         fprintf(stderr, "Error: unknown target setting '%s'\n", field);
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static int parseOptions(int argc, char *argv[], Options *opt)
+{
+   memset(opt, 0, sizeof(*opt));
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   opt->jobs = (cpus > 0) ? (int)cpus : 1;
+   opt->worker = -1;
+   opt->since = -1;
+
+   for(int i = 1; i < argc; i++)
+   {
+      const char *arg = argv[i];
+      if(strcmp(arg, "--compile") == 0)
+      {
+         opt->compile = 1;
+      }
+      else if(strcmp(arg, "--bisect") == 0)
+      {
+         opt->bisect = 1;
+      }
+      else if(strcmp(arg, "--jobs") == 0 && i + 1 < argc)
+      {
+         opt->jobs = atoi(argv[++i]);
+         if(opt->jobs < 1)
+         {
+            fprintf(stderr, "Error: --jobs needs a positive number\n");
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--trace") == 0 && i + 1 < argc)
+      {
+         opt->tracePath = argv[++i];
+      }
+      else if(strcmp(arg, "--redact") == 0)
+      {
+         opt->redactScanners = 1;
+         opt->doc.redact = 1;
+      }
+      else if(strcmp(arg, "--redact-terms") == 0 && i + 1 < argc)
+      {
+         opt->redactTerms = argv[++i];
+         opt->doc.redact = 1;
+      }
+      else if(strcmp(arg, "--highlight") == 0)
+      {
+         opt->doc.highlight = 1;
+      }
+      else if(strcmp(arg, "--engine") == 0 && i + 1 < argc)
+      {
+         const char *engine = argv[++i];
+         if(strcmp(engine, "lualatex") == 0)
+         {
+            opt->doc.engine = EngineLuaLatex;
+         }
+         else if(strcmp(engine, "pdflatex") == 0)
+         {
+            opt->doc.engine = EnginePdfLatex;
+         }
+         else
+         {
+            fprintf(stderr, "Error: unknown engine '%s'\n", engine);
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--emoji-dir") == 0 && i + 1 < argc)
+      {
+         opt->doc.emojiDir = argv[++i];
+      }
+      else if(strcmp(arg, "--proof") == 0)
+      {
+         opt->doc.proof = 1;
+      }
+      else if(strcmp(arg, "--plan") == 0 && i + 1 < argc)
+      {
+         opt->plan = atoi(argv[++i]);
+         if(opt->plan < 1)
+         {
+            fprintf(stderr, "Error: --plan needs a positive number of shards\n");
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--worker") == 0 && i + 1 < argc)
+      {
+         opt->worker = atoi(argv[++i]);
+         if(opt->worker < 0)
+         {
+            fprintf(stderr, "Error: --worker needs a shard number\n");
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--stitch") == 0)
+      {
+         opt->stitch = 1;
+      }
+      else if(strcmp(arg, "--attachment-cache") == 0)
+      {
+         opt->attachmentCache = 1;
+      }
+      else if(strcmp(arg, "--size-tolerance") == 0 && i + 1 < argc)
+      {
+         char *end;
+         double value = strtod(argv[++i], &end);
+         if(value < 0 || end == argv[i] || (*end != '\0' && strcmp(end, "%") != 0))
+         {
+            fprintf(stderr, "Error: --size-tolerance needs a number of bytes or a percentage\n");
+            return 0;
+         }
+         if(*end == '%')
+         {
+            opt->sizeTolerance.percent = value;
+         }
+         else
+         {
+            opt->sizeTolerance.bytes = (long long)value;
+         }
+         opt->approximateSizes = 1;
+      }
+      else if(strcmp(arg, "--analytics") == 0 && i + 1 < argc)
+      {
+         opt->analyticsPath = argv[++i];
+      }
+      else if(strcmp(arg, "--index") == 0)
+      {
+         opt->index = 1;
+      }
+      else if(strcmp(arg, "--dedup-quotes") == 0)
+      {
+         opt->dedupQuotes = 1;
+      }
+      else if(strcmp(arg, "--tail") == 0 && i + 1 < argc)
+      {
+         opt->tailCount = atoll(argv[++i]);
+         if(opt->tailCount < 1)
+         {
+            fprintf(stderr, "Error: --tail needs a positive number of messages\n");
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--since") == 0 && i + 1 < argc)
+      {
+         opt->since = parseSinceDate(argv[++i]);
+         if(opt->since < 0)
+         {
+            fprintf(stderr, "Error: --since needs a date as YYYY-MM-DD or YYYY-MM-DD HH:MM:SS\n");
+            return 0;
+         }
+      }
+      else if(strcmp(arg, "--query") == 0 && i + 1 < argc)
+      {
+         opt->query = argv[++i];
+      }
+      else if(strcmp(arg, "--target") == 0 && i + 1 < argc)
+      {
+         if(opt->targetCount == MaxTargets)
+         {
+            fprintf(stderr, "Error: at most %d targets\n", MaxTargets);
+            return 0;
+         }
+         if(!parseTarget(argv[++i], &opt->targets[opt->targetCount]))
+         {
+            return 0;
+         }
+         opt->targetCount++;
+      }
+      else if(arg[0] == '-' && arg[1] != '\0')
+      {
+         fprintf(stderr, "Error: unknown option '%s'\n", arg);
+         return 0;
+      }
+      else if(!opt->inputPath)
+      {
+         opt->inputPath = arg;
+      }
+      else
+      {
+         return 0;
+      }
+   }
+
+   if(opt->targetCount > 0 && (opt->compile || opt->bisect || opt->plan > 0 || opt->worker >= 0 || opt->stitch))
+   {
+      fprintf(stderr, "Error: --target cannot be combined with --compile, --bisect, --plan, --worker or --stitch\n");
+      return 0;
+   }
+   if(opt->analyticsPath && (opt->plan > 0 || opt->worker >= 0 || opt->stitch))
+   {
+      fprintf(stderr, "Error: --analytics needs a whole conversion, not --plan, --worker or --stitch\n");
+      return 0;
+   }
+   if(opt->dedupQuotes && (opt->plan > 0 || opt->worker >= 0 || opt->stitch))
+   {
+      fprintf(stderr, "Error: --dedup-quotes needs a whole conversion, not --plan, --worker or --stitch\n");
+      return 0;
+   }
+   if(opt->index && (opt->targetCount > 0 || opt->plan > 0 || opt->worker >= 0 || opt->stitch || opt->query))
+   {
+      fprintf(stderr, "Error: --index needs a single .tex output, not --target, --plan, --worker, --stitch or --query\n");
+      return 0;
+   }
+   if((opt->tailCount > 0 || opt->since >= 0) && (opt->bisect || opt->index || opt->plan > 0 || opt->worker >= 0 || opt->stitch || opt->query))
+   {
+      fprintf(stderr, "Error: --tail and --since cannot be combined with --bisect, --index, --plan, --worker, --stitch or --query\n");
+      return 0;
+   }
+   if(opt->doc.highlight && !opt->doc.redact)
+   {
+      fprintf(stderr, "Error: --highlight needs --redact or --redact-terms\n");
+      return 0;
+   }
+   if(opt->compile && opt->bisect)
+   {
+      fprintf(stderr, "Error: --compile and --bisect are exclusive\n");
+      return 0;
+   }
+
+   return opt->inputPath != NULL;
+}
+
+static void prepareAttachments(const Options *opt, const char *attachmentsDir, AttachmentList *list)
+{
+   // Loads the attachment list for the range from opt->startOffset on. With
+   // --tail or --since only the range's references are looked at: files that
+   // messages before it use are still free for its size-only references
+   loadAttachments(attachmentsDir, list, opt->approximateSizes ? opt->inputPath : NULL, opt->startOffset);
+}
+
+static AttachmentCache *openAttachmentCache(const Options *opt, AttachmentCache *cache)
+{
+   // Returns the cache for --attachment-cache, or NULL to match every reference
+   if(!opt->attachmentCache)
+   {
+      return NULL;
+   }
+   char cachePath[MaxPathLen];
+   replaceExtension(opt->inputPath, ".attcache", cachePath, sizeof(cachePath));
+   if(!attachmentCacheOpen(cache, cachePath))
+   {
+      attachmentCacheClose(cache, 0);
+      return NULL;
+   }
+   return cache;
+}
+
+static RecentMessage *openRecentMessages(const Options *opt)
+{
+   // Returns the table for --dedup-quotes, or NULL to write every quote
+   if(!opt->dedupQuotes)
+   {
+      return NULL;
+   }
+   RecentMessage *recent = (RecentMessage *)calloc(RecentMessageSlots, sizeof(RecentMessage));
+   if(!recent)
+   {
+      fatal("Out of memory allocating recent messages");
+   }
+   return recent;
+}
+
+static int finishAnalytics(const Options *opt, Analytics *analytics, const struct timespec *convertStart)
+{
+   // Writes the --analytics output and reports its share of the conversion pass
+   if(!analytics)
+   {
+      return 1;
+   }
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   double total = (double)(now.tv_sec - convertStart->tv_sec) + (double)(now.tv_nsec - convertStart->tv_nsec) / 1e9;
+   double spent = (double)analytics->spent.tv_sec + (double)analytics->spent.tv_nsec / 1e9;
+   if(analytics->sampled > 0)
+   {
+      spent *= (double)analytics->lines / (double)analytics->sampled;
+   }
+
+   int ok = analyticsWrite(analytics, opt->analyticsPath);
+   fprintf(stderr, "Analytics took about %.1f ms (%.1f%% of the conversion pass)\n", spent * 1000.0,
+           (total > 0) ? 100.0 * spent / total : 0.0);
+   analyticsFree(analytics);
+   return ok;
+}
+
+static int runConvert(const Options *opt, const char *attachmentsDir, Redactor *redactor)
+{
+   const char *inputPath = opt->inputPath;
+
+   // Generate output filename by replacing extension with .tex
+   char outputPath[MaxPathLen];
+   replaceExtension(inputPath, ".tex", outputPath, sizeof(outputPath));
+
+   AttachmentList list;
+   attachmentListInit(&list);
+   prepareAttachments(opt, attachmentsDir, &list);
+
+   FILE *in = fopen(inputPath, "rb");
+   if(!in)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", inputPath, strerror(errno));
+      attachmentListFree(&list);
+      return 0;
+   }
+
+   FILE *out = fopen(outputPath, "wb");
+   if(!out)
+   {
+      fprintf(stderr, "Error: could not open '%s' for writing: %s\n", outputPath, strerror(errno));
+      fclose(in);
+      attachmentListFree(&list);
+      return 0;
+   }
+
+   TexLayout layout;
+   MessageMarkList marks;
+   AttachmentMarkList attachmentMarks;
+   messageMarkListInit(&marks);
+   memset(&attachmentMarks, 0, sizeof(attachmentMarks));
+   layout.marks = &marks;
+   layout.attachments = &attachmentMarks;
+   int useMarks = opt->compile || opt->bisect;
+
+   writePreamble(out, &opt->doc);
+   layout.preambleEnd = (long long)ftello(out);
+   fputs("\\begin{document}\n\n", out);
+   layout.bodyStart = (long long)ftello(out);
+
+   Converter cv;
+   converterInit(&cv, out, &opt->doc, &list, useMarks ? &marks : NULL);
+   cv.redactor = redactor;
+   cv.tolerance = opt->approximateSizes ? &opt->sizeTolerance : NULL;
+   cv.attachmentMarks = opt->bisect ? &attachmentMarks : NULL;
+   AttachmentCache cache;
+   cv.cache = openAttachmentCache(opt, &cache);
+   Analytics analytics;
+   if(opt->analyticsPath)
+   {
+      analyticsInit(&analytics);
+      analytics.redactor = redactor;
+      cv.analytics = &analytics;
+   }
+   cv.recent = openRecentMessages(opt);
+   SearchIndex index;
+   if(opt->index)
+   {
+      searchIndexInit(&index, layout.bodyStart);
+      cv.index = &index;
+   }
+   if(useMarks)
+   {
+      // Content before the first message header belongs to the first shard
+      messageMarkListPush(&marks, layout.bodyStart, 1);
+   }
+
+   struct timespec convertStart;
+   clock_gettime(CLOCK_MONOTONIC, &convertStart);
+   convertRange(&cv, in, opt->startOffset, -1);
+
+   layout.bodyEnd = (long long)ftello(out);
+   fputs("\n\\end{document}\n", out);
+
+   fclose(out);
+   fclose(in);
+
+   fprintf(stderr, "Wrote %s\n", outputPath);
+   printStats(&cv.stats, redactor);
+
+   int ok = finishAnalytics(opt, cv.analytics, &convertStart);
+   if(cv.index)
+   {
+      char indexPath[MaxPathLen];
+      replaceExtension(inputPath, ".idx", indexPath, sizeof(indexPath));
+      ok = searchIndexWrite(cv.index, indexPath) && ok;
+      searchIndexFree(cv.index);
+   }
+   if(cv.cache && !attachmentCacheClose(cv.cache, 1))
+   {
+      ok = 0;
+   }
+   attachmentListFree(&list);
+   free(cv.recent);
+
+   if(opt->compile && !compileParallel(outputPath, &layout, &opt->doc, opt->jobs))
+   {
+      ok = 0;
+   }
+   if(opt->bisect && !bisectCompile(outputPath, &layout, &opt->doc, opt->jobs))
+   {
+      ok = 0;
+   }
+
+   attachmentMarkListFree(&attachmentMarks);
+   messageMarkListFree(&marks);
+   return ok;
+}
+
+static int runTargets(Options *opt, const char *attachmentsDir, Redactor *redactor)
+{
+   // Converts once, rendering every --target concurrently from the same chunks
+   AttachmentList list;
+   attachmentListInit(&list);
+   prepareAttachments(opt, attachmentsDir, &list);
+
+   FILE *in = fopen(opt->inputPath, "rb");
+   if(!in)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s\n", opt->inputPath, strerror(errno));
+      attachmentListFree(&list);
+      return 0;
+   }
+
+   FanOut fan;
+   memset(&fan, 0, sizeof(fan));
+   fan.targets = opt->targets;
+   fan.targetCount = opt->targetCount;
+   fan.title = opt->inputPath;
+   pthread_mutex_init(&fan.lock, NULL);
+   pthread_cond_init(&fan.changed, NULL);
+
+   int html = 0;
+   int opened = 0;
+   for(int i = 0; i < opt->targetCount; i++)
+   {
+      OutputTarget *t = &opt->targets[i];
+      t->fan = &fan;
+      t->doc = opt->doc;
+      t->proof = t->proof || opt->doc.proof;
+      t->doc.proof = (t->format == TargetTex) && t->proof;
+      html = html || (t->format == TargetHtml);
+      fan.needSizes = fan.needSizes || (t->format == TargetHtml) || t->doc.proof;
+
+      t->out = fopen(t->path, "wb");
+      if(!t->out)
+      {
+         fprintf(stderr, "Error: could not open '%s' for writing: %s\n", t->path, strerror(errno));
+         break;
+      }
+      targetLinkPrefix(t->path, t->linkPrefix, sizeof(t->linkPrefix));
+      opened++;
+   }
+   if(opened < opt->targetCount)
+   {
+      for(int i = 0; i < opened; i++)
+      {
+         fclose(opt->targets[i].out);
+      }
+      fclose(in);
+      attachmentListFree(&list);
+      return 0;
+   }
+
+   fanOutOpenChunk(&fan, html);
+   for(int i = 0; i < opt->targetCount; i++)
+   {
+      if(pthread_create(&opt->targets[i].thread, NULL, targetThread, &opt->targets[i]) != 0)
+      {
+         fatal("Could not start output thread");
+      }
+   }
+
+   Converter cv;
+   converterInit(&cv, fan.tex, &opt->doc, &list, NULL);
+   cv.html = fan.html;
+   cv.fan = &fan;
+   cv.redactor = redactor;
+   cv.tolerance = opt->approximateSizes ? &opt->sizeTolerance : NULL;
+   AttachmentCache cache;
+   cv.cache = openAttachmentCache(opt, &cache);
+   Analytics analytics;
+   if(opt->analyticsPath)
+   {
+      analyticsInit(&analytics);
+      analytics.redactor = redactor;
+      cv.analytics = &analytics;
+   }
+   cv.recent = openRecentMessages(opt);
+   struct timespec convertStart;
+   clock_gettime(CLOCK_MONOTONIC, &convertStart);
+   convertRange(&cv, in, opt->startOffset, -1);
+   int ok = !ferror(in);
+   fclose(in);
+
+   fanOutPublish(&fan, 0);
+   pthread_mutex_lock(&fan.lock);
+   fan.done = 1;
+   pthread_cond_broadcast(&fan.changed);
+   pthread_mutex_unlock(&fan.lock);
+
+   for(int i = 0; i < opt->targetCount; i++)
+   {
+      OutputTarget *t = &opt->targets[i];
+      pthread_join(t->thread, NULL);
+      if(t->ok)
+      {
+         fprintf(stderr, "Wrote %s\n", t->path);
+      }
+      else
+      {
+         fprintf(stderr, "Error: could not write '%s'\n", t->path);
+         ok = 0;
+      }
+   }
+   printStats(&cv.stats, redactor);
+   if(!finishAnalytics(opt, cv.analytics, &convertStart))
+   {
+      ok = 0;
+   }
+   if(cv.cache && !attachmentCacheClose(cv.cache, ok))
+   {
+      ok = 0;
+   }
+
+   for(int i = 0; i < FanQueueDepth; i++)
+   {
+      fanChunkFree(&fan.slots[i]);
+   }
+   pthread_cond_destroy(&fan.changed);
+   pthread_mutex_destroy(&fan.lock);
+   attachmentListFree(&list);
+   free(cv.recent);
+   return ok;
+}
+
+typedef struct
+{
+   long long message;
+   long long line;
+   uint64_t position;
+} IndexHit;
+
+static int indexTermOk(const IndexHeader *h, const IndexTerm *t)
+{
+   // The entry's string lies in the string table and its postings in the
+   // postings area, with room for the postings it claims (3 bytes at least each)
+   uint64_t stringsSize = h->postingsOffset - h->stringsOffset;
+   uint64_t postingsSize = h->size - h->postingsOffset;
+   return t->stringOffset <= stringsSize && t->stringLength <= stringsSize - t->stringOffset &&
+          t->postingsOffset <= postingsSize && t->postingsLength <= postingsSize - t->postingsOffset &&
+          t->postingCount <= t->postingsLength / 3;
+}
+
+static const IndexTerm *findIndexTerm(const unsigned char *base, const IndexHeader *h, const char *term, int *corrupt)
+{
+   // Binary search of the sorted term table; sets *corrupt and returns NULL
+   // on an entry that points outside the file
+   const IndexTerm *table = (const IndexTerm *)(base + h->termsOffset);
+   const char *strings = (const char *)(base + h->stringsOffset);
+   size_t termLen = strlen(term);
+   size_t lo = 0;
+   size_t hi = (size_t)h->termCount;
+   while(lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+      const IndexTerm *t = &table[mid];
+      if(!indexTermOk(h, t))
+      {
+         *corrupt = 1;
+         return NULL;
+      }
+      size_t common = (t->stringLength < termLen) ? t->stringLength : termLen;
+      int cmp = memcmp(strings + t->stringOffset, term, common);
+      if(cmp == 0)
+      {
+         cmp = (t->stringLength < termLen) ? -1 : (t->stringLength > termLen);
+      }
+      if(cmp == 0)
+      {
+         return t;
+      }
+      if(cmp < 0)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   return NULL;
+}
+
+static size_t decodePostings(const unsigned char *base, const IndexHeader *h, const IndexTerm *t, IndexHit *hits)
+{
+   // Returns the number of postings decoded, fewer if the list is corrupt
+   const unsigned char *p = base + h->postingsOffset + t->postingsOffset;
+   const unsigned char *end = p + t->postingsLength;
+   long long message = 0;
+   long long line = 0;
+   size_t n = 0;
+   while(n < t->postingCount)
+   {
+      uint64_t dm, dl, pos;
+      if(!(p = getVarint(p, end, &dm)) || !(p = getVarint(p, end, &dl)) || !(p = getVarint(p, end, &pos)))
+      {
+         break;
+      }
+      message += (long long)dm;
+      line += (long long)dl;
+      hits[n].message = message;
+      hits[n].line = line;
+      hits[n].position = pos;
+      n++;
+   }
+   return n;
+}
+
+static int runQuery(const char *inputPath, const char *query)
+{
+   // Looks up a term or phrase in "<name>.idx"; prints one line per matching
+   // input line: message number, .tex offset of the message, input line number
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   char indexPath[MaxPathLen];
+   replaceExtension(inputPath, ".idx", indexPath, sizeof(indexPath));
+   int fd = open(indexPath, O_RDONLY);
+   struct stat st;
+   if(fd < 0 || fstat(fd, &st) != 0)
+   {
+      fprintf(stderr, "Error: could not open '%s': %s (convert with --index first)\n", indexPath, strerror(errno));
+      if(fd >= 0)
+      {
+         close(fd);
+      }
+      return 0;
+   }
+   size_t size = (size_t)st.st_size;
+   const unsigned char *base = (size >= sizeof(IndexHeader)) ? (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : (const unsigned char *)MAP_FAILED;
+   close(fd);
+   const IndexHeader *h = (base != MAP_FAILED) ? (const IndexHeader *)base : NULL;
+   if(!h || memcmp(h->magic, IndexMagic, sizeof(h->magic)) != 0 || h->size != size ||
+      h->messageCount >= size / sizeof(uint64_t) || h->termCount > size / sizeof(IndexTerm) ||
+      h->messagesOffset > size || h->termsOffset > size || h->stringsOffset > size ||
+      h->messagesOffset + (h->messageCount + 1) * sizeof(uint64_t) > h->termsOffset ||
+      h->termsOffset + h->termCount * sizeof(IndexTerm) > h->stringsOffset ||
+      h->stringsOffset > h->postingsOffset || h->postingsOffset > size)
+   {
+      fprintf(stderr, "Error: '%s' is not a txt2tex index\n", indexPath);
+      if(h)
+      {
+         munmap((void *)base, size);
+      }
+      return 0;
+   }
+
+   // Phrase: every further term must follow in the same line
+   IndexHit *hits = NULL;
+   size_t hitCount = 0;
+   char term[IndexMaxTerm + 1];
+   size_t pos = 0;
+   size_t queryLen = strlen(query);
+   uint64_t k = 0;
+   int found = 1;
+   int corrupt = 0;
+   while(found && nextIndexTerm(query, queryLen, &pos, term) > 0)
+   {
+      const IndexTerm *t = findIndexTerm(base, h, term, &corrupt);
+      if(!t)
+      {
+         found = 0;
+         k++;
+         break;
+      }
+      IndexHit *postings = (IndexHit *)malloc(((size_t)t->postingCount + 1) * sizeof(IndexHit));
+      if(!postings)
+      {
+         fatal("Out of memory reading index");
+      }
+      size_t n = decodePostings(base, h, t, postings);
+      if(k == 0)
+      {
+         hits = postings;
+         hitCount = n;
+      }
+      else
+      {
+         // Both lists are ordered by (line, position)
+         size_t kept = 0;
+         size_t j = 0;
+         for(size_t i = 0; i < hitCount; i++)
+         {
+            uint64_t want = hits[i].position + k;
+            while(j < n && (postings[j].line < hits[i].line || (postings[j].line == hits[i].line && postings[j].position < want)))
+            {
+               j++;
+            }
+            if(j < n && postings[j].line == hits[i].line && postings[j].position == want)
+            {
+               hits[kept++] = hits[i];
+            }
+         }
+         hitCount = kept;
+         free(postings);
+      }
+      k++;
+      found = hitCount > 0;
+   }
+   if(k == 0 || corrupt)
+   {
+      if(corrupt)
+      {
+         fprintf(stderr, "Error: '%s' is corrupt\n", indexPath);
+      }
+      else
+      {
+         fprintf(stderr, "Error: --query needs at least one word\n");
+      }
+      free(hits);
+      munmap((void *)base, size);
+      return 0;
+   }
+
+   const uint64_t *messageOffsets = (const uint64_t *)(base + h->messagesOffset);
+   long long lines = 0;
+   long long messages = 0;
+   long long lastMessage = -1;   // Of the last printed line
+   for(size_t i = 0; found && i < hitCount; i++)
+   {
+      if((i > 0 && hits[i].line == hits[i - 1].line) || (uint64_t)hits[i].message > h->messageCount)
+      {
+         continue;
+      }
+      printf("%lld\t%llu\t%lld\n", hits[i].message, (unsigned long long)messageOffsets[hits[i].message], hits[i].line);
+      lines++;
+      messages += (hits[i].message != lastMessage);
+      lastMessage = hits[i].message;
+   }
+   free(hits);
+   munmap((void *)base, size);
+
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   double ms = (double)(now.tv_sec - start.tv_sec) * 1000.0 + (double)(now.tv_nsec - start.tv_nsec) / 1e6;
+   fprintf(stderr, "%lld lines in %lld messages (%.2f ms)\n", lines, messages, ms);
+   return 1;
+}
+
+int main(int argc, char *argv[])
+{
+   Options opt;
+   if(!parseOptions(argc, argv, &opt))
+   {
+      usage(argv[0]);
+      return 1;
+   }
+
+   const char *inputPath = opt.inputPath;
+   const char *attachmentsDir = "./attachments";
+
+   if(opt.tracePath)
+   {
+      traceInit();
+   }
+   lineRulesInit();
+
+   StrMap emojiCache;
+   strMapInit(&emojiCache);
+   opt.doc.emojiCache = &emojiCache;
+
+   Redactor redactor;
+   Redactor *activeRedactor = NULL;
+   if(opt.doc.redact)
+   {
+      redactorInit(&redactor, opt.redactScanners, opt.doc.highlight);
+      if(opt.redactTerms && !redactorLoadTerms(&redactor, opt.redactTerms))
+      {
+         redactorFree(&redactor);
+         return 1;
+      }
+      activeRedactor = &redactor;
+   }
+
+   int ok;
+   long long traceStart = traceBegin();
+   if(opt.tailCount > 0 || opt.since >= 0)
+   {
+      long long messages = 0;
+      opt.startOffset = findTailStart(inputPath, opt.tailCount, opt.since, &messages);
+      if(opt.startOffset < 0)
+      {
+         if(activeRedactor)
+         {
+            redactorFree(activeRedactor);
+         }
+         strMapFree(&emojiCache);
+         return 1;
+      }
+      fprintf(stderr, "Converting the last %lld messages, from byte %lld\n", messages, opt.startOffset);
+   }
+
+   if(opt.query)
+   {
+      ok = runQuery(inputPath, opt.query);
+   }
+   else if(opt.plan > 0)
+   {
+      // Distributed conversion: plan, per-shard workers, stitch
+      ok = runPlan(inputPath, attachmentsDir, opt.plan, opt.approximateSizes ? &opt.sizeTolerance : NULL);
+   }
+   else if(opt.worker >= 0)
+   {
+      ok = runWorker(inputPath, opt.worker, &opt.doc, activeRedactor);
+   }
+   else if(opt.stitch)
+   {
+      ok = runStitch(inputPath, &opt.doc);
+   }
+   else if(opt.targetCount > 0)
+   {
+      ok = runTargets(&opt, attachmentsDir, activeRedactor);
+   }
+   else
+   {
+      ok = runConvert(&opt, attachmentsDir, activeRedactor);
+   }
+   traceEnd("main", "txt2tex", traceStart, -1);
+
+   if(activeRedactor)
+   {
+      redactorFree(activeRedactor);
+   }
+   strMapFree(&emojiCache);
+
+   if(opt.tracePath && !traceWrite(opt.tracePath))
+   {
+      ok = 0;
+   }
+   return ok ? 0 : 1;
+}